@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "level_alloc.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+/*
+Function: level_alloc_policy_init()
+        Set an allocation policy to the compile-time defaults
+*/
+void level_alloc_policy_init(level_alloc_policy *policy)
+{
+    policy->huge_page = LEVEL_HUGE_PAGE;
+    policy->numa_policy = LEVEL_NUMA_POLICY;
+    policy->numa_node = -1;
+}
+
+/*
+Function: level_map_len()
+        Return the length of the mapping holding size bytes, which is the same whatever the policy
+        so that level_free() needs no policy; only a level of at least one huge page is rounded up to huge pages
+*/
+static uint64_t level_map_len(uint64_t size)
+{
+    uint64_t page_size = size < HUGE_PAGE_SIZE ? sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/*
+Function: level_numa_bind()
+        Apply the NUMA policy to a mapping before any of its pages is touched;
+        A failure, e.g., on a kernel without NUMA support, leaves the default placement
+*/
+static void level_numa_bind(level_alloc_policy *policy, void *addr, uint64_t len)
+{
+#ifdef SYS_mbind
+    unsigned long nodemask = 0;
+    int mode;
+    if (policy->numa_policy == LEVEL_NUMA_INTERLEAVE)
+    {
+        mode = MPOL_INTERLEAVE;
+        nodemask = ~0UL;                  // The kernel keeps the nodes that exist and are allowed
+    }
+    else if (policy->numa_policy == LEVEL_NUMA_LOCAL)
+    {
+        unsigned int cpu, node = policy->numa_node;
+        if (policy->numa_node < 0 && syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+            return;
+        if (node >= sizeof(nodemask) * 8)
+            return;
+        mode = MPOL_PREFERRED;
+        nodemask = 1UL << node;
+    }
+    else
+        return;
+    syscall(SYS_mbind, addr, len, mode, &nodemask, sizeof(nodemask) * 8, 0);
+#endif
+}
+
+/*
+Function: level_alloc()
+        Allocate size bytes of zeroed memory for a level, aligned to a huge page if it is at least one huge page long;
+        With huge pages, reserved hugetlbfs pages are used first, then transparent huge pages,
+        and the normal pages of the aligned mapping when neither is available;
+        A smaller level is mapped with normal pages, so that it does not take a whole huge page;
+        Return NULL if the memory cannot be mapped
+*/
+void *level_alloc(level_alloc_policy *policy, uint64_t size)
+{
+    uint64_t len = level_map_len(size);
+    void *addr = MAP_FAILED;
+
+    if (size < HUGE_PAGE_SIZE)
+    {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return NULL;
+        level_numa_bind(policy, addr, len);
+        return addr;
+    }
+
+#ifdef MAP_HUGETLB
+    if (policy->huge_page)
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (addr == MAP_FAILED)
+    {
+        // Map one more huge page and trim both ends, so that the level starts on a huge page boundary
+        uint8_t *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        uint8_t *aligned = (uint8_t *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > raw)
+            munmap(raw, aligned - raw);
+        munmap(aligned + len, raw + HUGE_PAGE_SIZE - aligned);
+        addr = aligned;
+#ifdef MADV_HUGEPAGE
+        if (policy->huge_page)
+            madvise(addr, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    level_numa_bind(policy, addr, len);
+    return addr;
+}
+
+/*
+Function: level_free()
+        Free a level allocated by level_alloc() with the same size
+*/
+void level_free(void *addr, uint64_t size)
+{
+    if (addr)
+        munmap(addr, level_map_len(size));
+}
@@ -1,19 +1,40 @@
 #include "level_hashing.h"
 
 /*
-Function: F_HASH()
-        Compute the first hash value of a key-value item
+Function: FS_HASH()
+        Compute the first and second hash values of a key-value item in a single pass
 */
-uint64_t F_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->f_seed));
+void FS_HASH(level_hash *level, const uint8_t *key, uint64_t *f_hash, uint64_t *s_hash) {
+    uint64_t hash_value[2];
+#if defined(INTEGER_KEY)
+    uint64_t int_key;
+    memcpy(&int_key, key, sizeof(uint64_t));
+    hash_integer(int_key, level->f_seed, level->s_seed, hash_value);
+#elif defined(BINARY_KEY)
+    hash_128((void *)key, KEY_LEN, level->f_seed, level->s_seed, hash_value);
+#else
+    hash_128((void *)key, strlen(key), level->f_seed, level->s_seed, hash_value);
+#endif
+    *f_hash = hash_value[0];
+    *s_hash = hash_value[1];
 }
 
 /*
-Function: S_HASH() 
-        Compute the second hash value of a key-value item
+Function: KEY_EQUAL()
+        Determine whether two keys are equal according to the type of keys;
+        A string key read during a modification may be torn, so it is compared within KEY_LEN bytes only
 */
-uint64_t S_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->s_seed));
+static inline int KEY_EQUAL(const uint8_t *key1, const uint8_t *key2) {
+#if defined(INTEGER_KEY)
+    uint64_t int_key1, int_key2;
+    memcpy(&int_key1, key1, sizeof(uint64_t));
+    memcpy(&int_key2, key2, sizeof(uint64_t));
+    return int_key1 == int_key2;
+#elif defined(BINARY_KEY)
+    return memcmp(key1, key2, KEY_LEN) == 0;
+#else
+    return strncmp(key1, key2, KEY_LEN) == 0;
+#endif
 }
 
 /*
@@ -21,7 +42,7 @@ Function: F_IDX()
         Compute the second hash location
 */
 uint64_t F_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2);
+    return hashKey & (capacity / 2 - 1);
 }
 
 /*
@@ -29,7 +50,7 @@ Function: S_IDX()
         Compute the second hash location
 */
 uint64_t S_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2) + capacity / 2;
+    return (hashKey & (capacity / 2 - 1)) + capacity / 2;
 }
 
 /*
@@ -48,6 +69,137 @@ void generate_seeds(level_hash *level)
     } while (level->f_seed == level->s_seed);
 }
 
+/*  Epoch-based reclamation:
+    An operation announces the global epoch in its thread's slot before it reads the current table and 
+    clears the slot when it finishes. After publishing a new table, a resizing advances the global epoch
+    and waits until no thread is still inside an operation begun in an older epoch; the old table and 
+    the levels it alone references can then be freed.
+*/
+static level_epoch thread_epoch[MAX_THREAD_NUM];
+static volatile uint64_t global_epoch = 1;
+static uint32_t epoch_thread_num = 0;
+static __thread int epoch_id = -1;
+
+/*
+Function: epoch_enter() 
+        Enter an operation and return the table it must use
+*/
+static inline level_table *epoch_enter(level_hash *level)
+{
+    if (epoch_id < 0)
+    {
+        epoch_id = __sync_fetch_and_add(&epoch_thread_num, 1);
+        if (epoch_id >= MAX_THREAD_NUM)
+        {
+            printf("Too many threads: at most %d threads are supported\n", MAX_THREAD_NUM);
+            exit(1);
+        }
+    }
+    thread_epoch[epoch_id].epoch = global_epoch;
+    __sync_synchronize();
+    return level->table;
+}
+
+/*
+Function: epoch_exit() 
+        Leave an operation; the table it used may be freed afterwards
+*/
+static inline void epoch_exit()
+{
+    barrier();
+    thread_epoch[epoch_id].epoch = 0;
+}
+
+/*
+Function: epoch_synchronize() 
+        Wait until every operation that may have read a previously published table has finished
+*/
+static void epoch_synchronize()
+{
+    uint64_t epoch = __sync_add_and_fetch(&global_epoch, 1);
+    uint32_t i, thread_num = epoch_thread_num;
+    for (i = 0; i < thread_num && i < MAX_THREAD_NUM; i ++) {
+        uint64_t e;
+        while ((e = thread_epoch[i].epoch) != 0 && e < epoch)
+            cpu_relax();
+    }
+}
+
+/*  Bucket versions:
+    A writer locks a bucket by making its version odd and unlocks it by making it even again, 
+    so every modification of the bucket changes its version. Readers take no lock: they record 
+    the versions of the buckets they search, read the slots, and search again if a version was odd 
+    or has changed. As a relocation changes the versions of both its source and destination buckets,
+    a search never misses an item that is moved while it runs.
+*/
+
+/*
+Function: bucket_lock() 
+        Lock a bucket against the other writers
+*/
+static inline void bucket_lock(level_bucket *bucket)
+{
+    while (1) {
+        uint16_t version = bucket->version;
+        if (!(version & 1) && __sync_bool_compare_and_swap(&bucket->version, version, version + 1))
+            return;
+        cpu_relax();
+    }
+}
+
+/*
+Function: bucket_trylock() 
+        Try to lock a bucket once; return 0 on success
+*/
+static inline int bucket_trylock(level_bucket *bucket)
+{
+    uint16_t version = bucket->version;
+    return (version & 1) || !__sync_bool_compare_and_swap(&bucket->version, version, version + 1);
+}
+
+/*
+Function: bucket_unlock() 
+        Unlock a bucket, publishing a new version
+*/
+static inline void bucket_unlock(level_bucket *bucket)
+{
+    barrier();
+    bucket->version ++;
+}
+
+/*
+Function: bucket_read_begin() 
+        Wait until no writer modifies a bucket and return its version
+*/
+static inline uint16_t bucket_read_begin(level_bucket *bucket)
+{
+    uint16_t version;
+    while ((version = bucket->version) & 1)
+        cpu_relax();
+    barrier();
+    return version;
+}
+
+/*
+Function: bucket_read_retry() 
+        Return 1 if a bucket was modified since its version was read
+*/
+static inline int bucket_read_retry(level_bucket *bucket, uint16_t version)
+{
+    barrier();
+    return bucket->version != version;
+}
+
+/*
+Function: level_alloc_buckets() 
+        Allocate a level of zeroed buckets following the allocation policy of the table;
+        The level starts on a page, so that no bucket spans more cache lines than its size requires
+*/
+static level_bucket *level_alloc_buckets(level_hash *level, uint64_t bucket_num)
+{
+    return level_alloc(&level->alloc_policy, bucket_num*sizeof(level_bucket));
+}
+
 /*
 Function: level_init() 
         Initialize a level hash table
@@ -55,44 +207,121 @@ Function: level_init()
 level_hash *level_init(uint64_t level_size)
 {
     level_hash *level = malloc(sizeof(level_hash));
-    if (!level)
+    level_table *table = calloc(1, sizeof(level_table));
+    if (!level || !table)
     {
         printf("The level hash table initialization fails:1\n");
         exit(1);
     }
 
-    level->level_size = level_size;
-    level->addr_capacity = pow(2, level_size);
-    level->total_capacity = pow(2, level_size) + pow(2, level_size - 1);
-    level->buckets[0] = calloc(pow(2, level_size), sizeof(level_bucket));
-    level->buckets[1] = calloc(pow(2, level_size - 1), sizeof(level_bucket));
-    level->level_locks[0] = calloc(pow(2, level_size), sizeof(level_locks));
-    level->level_locks[1] = calloc(pow(2, level_size - 1), sizeof(level_locks));
+    table->level_size = level_size;
+    table->addr_capacity = pow(2, level_size);
+    table->total_capacity = pow(2, level_size) + pow(2, level_size - 1);
+    level_alloc_policy_init(&level->alloc_policy);
+    table->buckets[0] = level_alloc_buckets(level, pow(2, level_size));
+    table->buckets[1] = level_alloc_buckets(level, pow(2, level_size - 1));
+    level->table = table;
 
     generate_seeds(level);
     level->level_resize = 0;
+    level->resize_lock = SPINLOCK_INITIALIZER;
+    memset(level->item_counter, 0, sizeof(level->item_counter));
+    level->expand_watermark = EXPAND_WATERMARK;
+    level->expand_threshold = 0;
+    level->expander_running = 0;
+    pthread_mutex_init(&level->expander_mutex, NULL);
+    pthread_cond_init(&level->expander_cond, NULL);
     
-    if (!level->buckets[0] || !level->buckets[1])
+    if (!table->buckets[0] || !table->buckets[1])
     {
         printf("The level hash table initialization fails:2\n");
         exit(1);
     }
 
     printf("Level hashing: ASSOC_NUM %d, KEY_LEN %d, VALUE_LEN %d \n", ASSOC_NUM, KEY_LEN, VALUE_LEN);
-    printf("The number of top-level buckets: %ld\n", level->addr_capacity);
-    printf("The number of all buckets: %ld\n", level->total_capacity);
-    printf("The number of all entries: %ld\n", level->total_capacity*ASSOC_NUM);
+    printf("The number of top-level buckets: %ld\n", table->addr_capacity);
+    printf("The number of all buckets: %ld\n", table->total_capacity);
+    printf("The number of all entries: %ld\n", table->total_capacity*ASSOC_NUM);
     printf("The level hash table initialization succeeds!\n");
     return level;
 }
 
 /*
-Function: level_resize()
-        Expand a level hash table in place;
-        Put a new level on the top of the old hash table and only rehash the
-        items in the bottom level of the old hash table;
+Function: table_insert() 
+        Insert a key-value item into the top and bottom levels of a table;
+*/
+static uint8_t table_insert(level_hash *level, level_table *table, uint8_t *key, uint8_t *value);
+
+/*
+Function: bucket_try_put() 
+        Put a key-value item into an empty slot of a bucket under its lock; return 0 on success
 */
-void level_resize(level_hash *level) 
+static inline uint8_t bucket_try_put(level_bucket *bucket, uint8_t *key, uint8_t *value);
+
+/*  Reserved buckets:
+    An item in the first half of the old bottom level is there by its first hash value, and one in the second half
+    by its second hash value. The same hash value maps an old-bottom bucket to four top-level buckets in the same half
+    of the new top level, which only its items may take until it is rehashed. As a bucket holds no more items than
+    any of them, the rehashing always finds a slot, while new items go directly to the other top-level buckets.
+*/
+
+/*
+Function: top_reserved() 
+        Return 1 if a top-level bucket is reserved for the items of an old-bottom bucket not rehashed yet
+*/
+static inline int top_reserved(level_table *table, uint64_t idx)
+{
+    if (table->buckets[2] == NULL)
+        return 0;
+    uint64_t half = table->addr_capacity >> 1, old_half = table->addr_capacity >> 3;
+    uint64_t old_idx = idx < half ? (idx & (old_half - 1)) : ((idx - half) & (old_half - 1)) + old_half;
+    // No item enters the old bottom level any more, so a bucket once found empty stays empty
+    return *(volatile uint8_t *)&table->buckets[2][old_idx].token != 0;
+}
+
+/*
+Function: table_rehash_bucket() 
+        Rehash the items of the next old-bottom bucket into the top-level buckets reserved for them;
+        Return 1 if no bucket is left to be rehashed
+*/
+static uint8_t table_rehash_bucket(level_hash *level, level_table *table)
+{
+    uint64_t old_idx = table->rehash_next ++;
+    if (old_idx >= (table->addr_capacity >> 2))
+        return 1;
+
+    // The bucket stays locked until its items are visible in the top level, so a search that finds them gone finds them there
+    uint64_t i, f_hash, s_hash, idx;
+    level_bucket *old_bucket = &table->buckets[2][old_idx];
+    bucket_lock(old_bucket);
+    for(i = 0; i < ASSOC_NUM; i ++){
+        if (GET_BIT(old_bucket->token, i))
+        {
+            FS_HASH(level, old_bucket->slot[i].key, &f_hash, &s_hash);
+            if (old_idx < (table->addr_capacity >> 3))
+                idx = F_IDX(f_hash, table->addr_capacity);
+            else
+                idx = S_IDX(s_hash, table->addr_capacity);
+            if (bucket_try_put(&table->buckets[0][idx], old_bucket->slot[i].key, old_bucket->slot[i].value))
+            {
+                printf("The resizing fails: 3\n");
+                exit(1);                    
+            }
+            SET_BIT(old_bucket->token, i, 0);
+        }
+    }
+    bucket_unlock(old_bucket);
+    return 0;
+}
+
+/*
+Function: level_resize_start()
+        Start expanding a level hash table in place while other threads keep operating on it;
+        Put a new level on the top of the old hash table, which keeps its old bottom level 
+        searchable until level_resize_finish() rehashes its items;
+        Return 1 if another thread was already resizing the table, after waiting for it to finish
+*/
+uint8_t level_resize_start(level_hash *level) 
 {
     if (!level)
     {
@@ -100,109 +329,267 @@ void level_resize(level_hash *level)
         exit(1);
     }
 
-    level->addr_capacity = pow(2, level->level_size + 1);
-    level_bucket *newBuckets = calloc(level->addr_capacity, sizeof(level_bucket));
-    if (!newBuckets) {
+    if (spin_trylock(&level->resize_lock))
+    {
+        while (level->resize_lock)
+            cpu_relax();
+        return 1;
+    }
+
+    level_table *old_table = level->table;
+    level_table *table = malloc(sizeof(level_table));
+    if (!table) {
         printf("The resizing fails: 2\n");
         exit(1);
     }
-    
-    uint64_t old_idx;
-    for (old_idx = 0; old_idx < pow(2, level->level_size - 1); old_idx ++) {
-        uint64_t i, j;
-        for(i = 0; i < ASSOC_NUM; i ++){
-            if (level->buckets[1][old_idx].token[i] == 1)
-            {
-                uint8_t *key = level->buckets[1][old_idx].slot[i].key;
-                uint8_t *value = level->buckets[1][old_idx].slot[i].value;
-
-                uint64_t f_idx = F_IDX(F_HASH(level, key), level->addr_capacity);
-                uint64_t s_idx = S_IDX(S_HASH(level, key), level->addr_capacity);
-
-                uint8_t insertSuccess = 0;
-                for(j = 0; j < ASSOC_NUM; j ++){                            
-                    /*  The rehashed item is inserted into the less-loaded bucket between 
-                        the two hash locations in the new level
-                    */
-                    if (newBuckets[f_idx].token[j] == 0)
-                    {
-                        memcpy(newBuckets[f_idx].slot[j].key, key, KEY_LEN);
-                        memcpy(newBuckets[f_idx].slot[j].value, value, VALUE_LEN);
-                        newBuckets[f_idx].token[j] = 1;
-                        insertSuccess = 1;
-
-                        break;
-                    }
-                    if (newBuckets[s_idx].token[j] == 0)
-                    {
-                        memcpy(newBuckets[s_idx].slot[j].key, key, KEY_LEN);
-                        memcpy(newBuckets[s_idx].slot[j].value, value, VALUE_LEN);
-                        newBuckets[s_idx].token[j] = 1;
-                        insertSuccess = 1;
-
-                        break;
-                    }
-                }
-                if(!insertSuccess){
-                    printf("The resizing fails: 3\n");
-                    exit(1);                    
-                }
-				
-				level->buckets[1][old_idx].token[i] = 0;
-            }
-        }
+
+    /*  The new level becomes the top level at once, so new items never go to the old bottom level;
+        the old bottom level stays searchable as the third level until its items are rehashed
+    */
+    table->level_size = old_table->level_size + 1;
+    table->addr_capacity = pow(2, table->level_size);
+    table->total_capacity = pow(2, table->level_size) + pow(2, table->level_size - 1);
+    table->buckets[0] = level_alloc_buckets(level, table->addr_capacity);
+    table->buckets[1] = old_table->buckets[0];
+    table->buckets[2] = old_table->buckets[1];
+    if (!table->buckets[0]) {
+        printf("The resizing fails: 2\n");
+        exit(1);
     }
 
-    level->level_size ++;
-    level->total_capacity = pow(2, level->level_size) + pow(2, level->level_size - 1);
+    table->rehash_ready = 0;
+    table->rehash_next = 0;
+    __sync_synchronize();
+    level->table = table;
+    level->level_resize ++;
+    // No operation can still place an item in the old bottom level once the operations that saw the old table have finished
+    epoch_synchronize();
+    free(old_table);
+    table->rehash_ready = 1;
+    return 0;
+}
 
-    free(level->buckets[1]);
-    level->buckets[1] = level->buckets[0];
-    level->buckets[0] = newBuckets;
-    newBuckets = NULL;
+/*
+Function: level_resize_finish()
+        Rehash the items in the old bottom level and publish the final two levels;
+        Only the thread whose level_resize_start() returned 0 calls it
+*/
+void level_resize_finish(level_hash *level) 
+{
+    // No other thread publishes a table before the resize lock is released
+    level_table *table = level->table;
+    while (!table_rehash_bucket(level, table))
+        ;
 
-    level->level_resize ++;
+    level_table *final_table = malloc(sizeof(level_table));
+    if (!final_table) {
+        printf("The resizing fails: 2\n");
+        exit(1);
+    }
+    *final_table = *table;
+    final_table->buckets[2] = NULL;
+    __sync_synchronize();
+    level->table = final_table;
+    epoch_synchronize();
+
+    level_free(table->buckets[2], (table->addr_capacity >> 2)*sizeof(level_bucket));
+    free(table);
+    spin_unlock(&level->resize_lock);
 }
 
+/*
+Function: level_resize()
+        Expand a level hash table in place while other threads keep operating on it;
+        Put a new level on the top of the old hash table and only rehash the
+        items in the bottom level of the old hash table;
+        Return 1 if another thread was already resizing the table, after waiting for it to finish
+*/
+uint8_t level_resize(level_hash *level) 
+{
+    if (level_resize_start(level))
+        return 1;
+    level_resize_finish(level);
+    return 0;
+}
 
 /*
-Function: level_query() 
-        Lookup a key-value item in level hash table;
+Function: level_count() 
+        Add n to the item count of the calling thread, which has entered an operation before
 */
-uint8_t level_query(level_hash *level, uint8_t *key, uint8_t *value)
+static inline void level_count(level_hash *level, int64_t n)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][f_idx].s_lock[j]);
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                memcpy(value, level->buckets[i][f_idx].slot[j].value, VALUE_LEN);
-                spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
+    int64_t item_num = level->item_counter[epoch_id].item_num += n;
+    // The counts are summed only every EXPAND_CHECK_STEP insertions of a thread
+    if (n > 0 && level->expander_running && item_num % EXPAND_CHECK_STEP == 0 && level_item_num(level) >= level->expand_threshold)
+    {
+        pthread_mutex_lock(&level->expander_mutex);
+        pthread_cond_signal(&level->expander_cond);
+        pthread_mutex_unlock(&level->expander_mutex);
+    }
+}
+
+/*
+Function: level_item_num() 
+        Return the approximate number of items, summing the counts of all threads without stopping them
+*/
+uint64_t level_item_num(level_hash *level)
+{
+    int64_t item_num = 0;
+    uint32_t i, thread_num = epoch_thread_num;
+    for (i = 0; i < thread_num && i < MAX_THREAD_NUM; i ++)
+        item_num += level->item_counter[i].item_num;
+    // An item deleted by another thread than its inserter may be counted off first
+    return item_num > 0 ? item_num : 0;
+}
+
+/*
+Function: level_expander_threshold() 
+        Set the number of items at which the current table is resized
+*/
+static void level_expander_threshold(level_hash *level)
+{
+    // The table may be freed by a resizing, so its capacity is read within an epoch
+    level_table *table = epoch_enter(level);
+    level->expand_threshold = table->total_capacity*ASSOC_NUM*level->expand_watermark;
+    epoch_exit();
+}
+
+/*
+Function: level_expander_run() 
+        Resize the table whenever its approximate load factor reaches the expansion watermark;
+        The thread sleeps until an insertion finds the watermark reached, and the mutex it holds 
+        while checking the count makes such an insertion wait until it sleeps
+*/
+static void *level_expander_run(void *arg)
+{
+    level_hash *level = arg;
+    pthread_mutex_lock(&level->expander_mutex);
+    while (level->expander_running)
+    {
+        level_expander_threshold(level);
+        if (level_item_num(level) >= level->expand_threshold)
+        {
+            pthread_mutex_unlock(&level->expander_mutex);
+            level_resize(level);
+            pthread_mutex_lock(&level->expander_mutex);
         }
+        else
+            pthread_cond_wait(&level->expander_cond, &level->expander_mutex);
+    }
+    pthread_mutex_unlock(&level->expander_mutex);
+    return NULL;
+}
+
+/*
+Function: level_start_expander() 
+        Start a thread that expands the table in the background before insertions begin to fail;
+        The thread takes one of the MAX_THREAD_NUM epoch slots
+*/
+void level_start_expander(level_hash *level)
+{
+    if (level->expander_running)
+        return;
+    level_expander_threshold(level);
+    level->expander_running = 1;
+    if (pthread_create(&level->expander, NULL, level_expander_run, level))
+    {
+        printf("The expansion thread fails to start\n");
+        exit(1);
+    }
+}
+
+/*
+Function: level_stop_expander() 
+        Stop the expansion thread, waiting for a resizing it is performing
+*/
+void level_stop_expander(level_hash *level)
+{
+    if (!level->expander_running)
+        return;
+    pthread_mutex_lock(&level->expander_mutex);
+    level->expander_running = 0;
+    pthread_cond_signal(&level->expander_cond);
+    pthread_mutex_unlock(&level->expander_mutex);
+    pthread_join(level->expander, NULL);
+}
+
+/*
+Function: table_probe_num() 
+        Set the levels an operation searches, in search order, and return their number;
+        The level being rehashed is searched first: an item that has left it is already in the other levels
+*/
+static inline int table_probe_num(level_table *table, uint64_t *probe)
+{
+    int n = 0;
+    if (table->buckets[2] != NULL)
+        probe[n ++] = 2;
+    probe[n ++] = 0;
+    probe[n ++] = 1;
+    return n;
+}
+
+/*
+Function: table_search() 
+        Search a key-value item without taking any lock, and copy its value if value is not NULL;
+        Return the slot of the item and set its level and bucket, or return -1 if there is no such item
+*/
+static int table_search(level_hash *level, level_table *table, uint8_t *key, uint8_t *value, uint64_t *found_level, uint64_t *found_idx)
+{
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
+    uint64_t probe[3];
+    int probe_num = table_probe_num(table, probe);
+
+    uint64_t bucket_level[6], bucket_idx[6];
+    uint16_t version[6];
+    int bucket_num = 0, n, b, j;
+    for(n = 0; n < probe_num; n ++){
+        bucket_level[bucket_num] = probe[n];
+        bucket_idx[bucket_num ++] = F_IDX(f_hash, table->addr_capacity >> probe[n]);
+        bucket_level[bucket_num] = probe[n];
+        bucket_idx[bucket_num ++] = S_IDX(s_hash, table->addr_capacity >> probe[n]);
+    }
+
+retry:
+    for(b = 0; b < bucket_num; b ++)
+        version[b] = bucket_read_begin(&table->buckets[bucket_level[b]][bucket_idx[b]]);
+
+    for(b = 0; b < bucket_num; b ++){
+        level_bucket *bucket = &table->buckets[bucket_level[b]][bucket_idx[b]];
         for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][s_idx].s_lock[j]);
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {    
-                memcpy(value, level->buckets[i][s_idx].slot[j].value, VALUE_LEN);
-                spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
-                return 0;
+            // A key read during a modification may be torn, so it is compared within its bounds only
+            if (GET_BIT(bucket->token, j)&&KEY_EQUAL(bucket->slot[j].key, key))
+            {
+                if (value)
+                    memcpy(value, bucket->slot[j].value, VALUE_LEN);
+                if (bucket_read_retry(&table->buckets[bucket_level[b]][bucket_idx[b]], version[b]))
+                    goto retry;
+                *found_level = bucket_level[b];
+                *found_idx = bucket_idx[b];
+                return j;
             }
-            spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
     }
 
-    return 1;
+    // The item is absent only if none of the buckets was modified during the search
+    for(b = 0; b < bucket_num; b ++){
+        if (bucket_read_retry(&table->buckets[bucket_level[b]][bucket_idx[b]], version[b]))
+            goto retry;
+    }
+    return -1;
+}
+
+/*
+Function: level_query() 
+        Lookup a key-value item in level hash table;
+*/
+uint8_t level_query(level_hash *level, uint8_t *key, uint8_t *value)
+{
+    level_table *table = epoch_enter(level);
+    uint64_t i, idx;
+    int j = table_search(level, table, key, value, &i, &idx);
+    epoch_exit();
+    return j == -1;
 }
 
 
@@ -212,157 +599,184 @@ Function: level_delete()
 */
 uint8_t level_delete(level_hash *level, uint8_t *key)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][f_idx].s_lock[j]);
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                level->buckets[i][f_idx].token[j] = 0;
-                spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-        }
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][s_idx].s_lock[j]);
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {
-                level->buckets[i][s_idx].token[j] = 0;
-                spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
+    level_table *table = epoch_enter(level);
+    uint64_t i, idx;
+    int j;
+    while ((j = table_search(level, table, key, NULL, &i, &idx)) != -1) {
+        // The item may have been moved or deleted after it was found
+        bucket_lock(&table->buckets[i][idx]);
+        if (GET_BIT(table->buckets[i][idx].token, j)&&KEY_EQUAL(table->buckets[i][idx].slot[j].key, key))
+        {
+            SET_BIT(table->buckets[i][idx].token, j, 0);
+            bucket_unlock(&table->buckets[i][idx]);
+            level_count(level, -1);
+            epoch_exit();
+            return 0;
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+        bucket_unlock(&table->buckets[i][idx]);
     }
 
+    epoch_exit();
     return 1;
 }
 
 /*
 Function: level_update() 
         Update the value of a key-value item in level hash table;
-        The function can be optimized by using the dynamic search scheme
 */
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][f_idx].s_lock[j]);
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                memcpy(level->buckets[i][f_idx].slot[j].value, new_value, VALUE_LEN);
-                spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-        }
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[i][s_idx].s_lock[j]);
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {
-                memcpy(level->buckets[i][s_idx].slot[j].value, new_value, VALUE_LEN);
-                spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
+    level_table *table = epoch_enter(level);
+    uint64_t i, idx;
+    int j;
+    while ((j = table_search(level, table, key, NULL, &i, &idx)) != -1) {
+        // The item may have been moved or deleted after it was found
+        bucket_lock(&table->buckets[i][idx]);
+        if (GET_BIT(table->buckets[i][idx].token, j)&&KEY_EQUAL(table->buckets[i][idx].slot[j].key, key))
+        {
+            memcpy(table->buckets[i][idx].slot[j].value, new_value, VALUE_LEN);
+            bucket_unlock(&table->buckets[i][idx]);
+            epoch_exit();
+            return 0;
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+        bucket_unlock(&table->buckets[i][idx]);
     }
 
+    epoch_exit();
     return 1;
 }
 
 /*
 Function: level_insert() 
         Insert a key-value item into level hash table;
+        During a resizing, the item goes directly to the new top level, except to the buckets reserved for the
+        items of the old bottom level not rehashed yet;
+        While the expansion thread runs, a full table is resized and the insertion retried, so it never fails
 */
 uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
+    level_table *table;
+retry:
+    table = epoch_enter(level);
+    if (table->buckets[2] != NULL && !table->rehash_ready)
+    {
+        // An operation that saw the previous table may still put an item in the old bottom level,
+        // and the resizing waits for this operation to leave its epoch before it starts rehashing
+        epoch_exit();
+        cpu_relax();
+        goto retry;
+    }
+    uint8_t ret = table_insert(level, table, key, value);
+    if (!ret)
+        level_count(level, 1);
+    epoch_exit();
+    if (ret && level->expander_running)
+    {
+        level_resize(level);
+        goto retry;
+    }
+    return ret;
+}
 
-    uint64_t i, j;
+/*
+Function: bucket_first_empty() 
+        Return the first empty slot of a bucket, or ASSOC_NUM if the bucket is full
+*/
+static inline int bucket_first_empty(level_bucket *bucket)
+{
+    int j;
+    for(j = 0; j < ASSOC_NUM; j ++){
+        if (!GET_BIT(bucket->token, j))
+            return j;
+    }
+    return ASSOC_NUM;
+}
+
+static inline uint8_t bucket_try_put(level_bucket *bucket, uint8_t *key, uint8_t *value)
+{
+    bucket_lock(bucket);
+    int j = bucket_first_empty(bucket);
+    if (j < ASSOC_NUM)
+    {
+        memcpy(bucket->slot[j].key, key, KEY_LEN);
+        memcpy(bucket->slot[j].value, value, VALUE_LEN);
+        SET_BIT(bucket->token, j, 1);
+        bucket_unlock(bucket);
+        return 0;
+    }
+    bucket_unlock(bucket);
+    return 1;
+}
+
+/*
+Function: level_try_put() 
+        Put a key-value item into whichever of its two buckets in a level has the first empty slot, 
+        or the other one if it is full by the time it is locked;
+        Return 0 on success
+*/
+static inline uint8_t level_try_put(level_table *table, uint64_t i, uint64_t f_idx, uint64_t s_idx, uint8_t *key, uint8_t *value)
+{
+    int f_reserved = i == 0 && top_reserved(table, f_idx);
+    int s_reserved = i == 0 && top_reserved(table, s_idx);
+    if (f_reserved || s_reserved)
+        return (f_reserved || bucket_try_put(&table->buckets[i][f_idx], key, value)) && (s_reserved || bucket_try_put(&table->buckets[i][s_idx], key, value));
+    if (bucket_first_empty(&table->buckets[i][s_idx]) < bucket_first_empty(&table->buckets[i][f_idx]))
+        return bucket_try_put(&table->buckets[i][s_idx], key, value) && bucket_try_put(&table->buckets[i][f_idx], key, value);
+    return bucket_try_put(&table->buckets[i][f_idx], key, value) && bucket_try_put(&table->buckets[i][s_idx], key, value);
+}
+
+static uint8_t table_insert(level_hash *level, level_table *table, uint8_t *key, uint8_t *value)
+{
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
+    uint64_t f_idx = F_IDX(f_hash, table->addr_capacity);
+    uint64_t s_idx = S_IDX(s_hash, table->addr_capacity);
+
+    uint64_t i;
     int empty_location;
 
     for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){        
-            /*  The new item is inserted into the less-loaded bucket between 
-                the two hash locations in each level           
-            */		
-            spin_lock(&level->level_locks[i][f_idx].s_lock[j]);
-            if (level->buckets[i][f_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[i][f_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[i][f_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[i][f_idx].token[j] = 1;
-                spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][f_idx].s_lock[j]);
-            spin_lock(&level->level_locks[i][s_idx].s_lock[j]);
-            if (level->buckets[i][s_idx].token[j] == 0) 
-            {
-                memcpy(level->buckets[i][s_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[i][s_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[i][s_idx].token[j] = 1;
-                spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
-                return 0;
-            }
-            spin_unlock(&level->level_locks[i][s_idx].s_lock[j]);
-        }
+        /*  The new item is inserted into the first empty slot of the two hash 
+            locations in each level           
+        */
+        if (!level_try_put(table, i, f_idx, s_idx, key, value))
+            return 0;
 
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+        f_idx = F_IDX(f_hash, table->addr_capacity / 2);
+        s_idx = S_IDX(s_hash, table->addr_capacity / 2);
     }
 
-    f_idx = F_IDX(f_hash, level->addr_capacity);
-    s_idx = S_IDX(s_hash, level->addr_capacity);
+    f_idx = F_IDX(f_hash, table->addr_capacity);
+    s_idx = S_IDX(s_hash, table->addr_capacity);
     
     for(i = 0; i < 2; i++){
-        if(!try_movement(level, f_idx, i, key, value)){
+        if(!try_movement(level, table, f_idx, i, key, value)){
             return 0;
         }
-        if(!try_movement(level, s_idx, i, key, value)){
+        if(!try_movement(level, table, s_idx, i, key, value)){
             return 0;
         }
 
-        f_idx = F_IDX(f_hash, level->addr_capacity/2);
-        s_idx = S_IDX(s_hash, level->addr_capacity/2);        
+        f_idx = F_IDX(f_hash, table->addr_capacity/2);
+        s_idx = S_IDX(s_hash, table->addr_capacity/2);        
     }
 
     if(level->level_resize > 0){
-        empty_location = b2t_movement(level, f_idx);
+        empty_location = b2t_movement(level, table, f_idx);
         if(empty_location != -1){
-            memcpy(level->buckets[1][f_idx].slot[empty_location].key, key, KEY_LEN);
-            memcpy(level->buckets[1][f_idx].slot[empty_location].value, value, VALUE_LEN);
-            level->buckets[1][f_idx].token[empty_location] = 1;
-            spin_unlock(&level->level_locks[1][f_idx].s_lock[empty_location]);
+            memcpy(table->buckets[1][f_idx].slot[empty_location].key, key, KEY_LEN);
+            memcpy(table->buckets[1][f_idx].slot[empty_location].value, value, VALUE_LEN);
+            SET_BIT(table->buckets[1][f_idx].token, empty_location, 1);
+            bucket_unlock(&table->buckets[1][f_idx]);
             return 0;
         }
 
-        empty_location = b2t_movement(level, s_idx);
+        empty_location = b2t_movement(level, table, s_idx);
         if(empty_location != -1){
-            memcpy(level->buckets[1][s_idx].slot[empty_location].key, key, KEY_LEN);
-            memcpy(level->buckets[1][s_idx].slot[empty_location].value, value, VALUE_LEN);
-            level->buckets[1][s_idx].token[empty_location] = 1;
-            spin_unlock(&level->level_locks[1][s_idx].s_lock[empty_location]);
+            memcpy(table->buckets[1][s_idx].slot[empty_location].key, key, KEY_LEN);
+            memcpy(table->buckets[1][s_idx].slot[empty_location].value, value, VALUE_LEN);
+            SET_BIT(table->buckets[1][s_idx].token, empty_location, 1);
+            bucket_unlock(&table->buckets[1][s_idx]);
             return 0;
         }
     }
@@ -373,47 +787,59 @@ uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
 /*
 Function: try_movement() 
         Try to move an item from the current bucket to its same-level alternative bucket;
+        The alternative bucket is only tried to be locked, since another thread may hold it while waiting for the current bucket;
+        Top-level buckets reserved for the rehashing are skipped
 */
-uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value)
+uint8_t try_movement(level_hash *level, level_table *table, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value)
 {
     uint64_t i, j, jdx;
+    if (level_num == 0 && top_reserved(table, idx))
+        return 1;
 
+    bucket_lock(&table->buckets[level_num][idx]);
     for(i = 0; i < ASSOC_NUM; i ++){
-        spin_lock(&level->level_locks[level_num][idx].s_lock[i]);
-        uint8_t *m_key = level->buckets[level_num][idx].slot[i].key;
-        uint8_t *m_value = level->buckets[level_num][idx].slot[i].value;
-        uint64_t f_hash = F_HASH(level, m_key);
-        uint64_t s_hash = S_HASH(level, m_key);
-        uint64_t f_idx = F_IDX(f_hash, level->addr_capacity/(1+level_num));
-        uint64_t s_idx = S_IDX(s_hash, level->addr_capacity/(1+level_num));
+        if (!GET_BIT(table->buckets[level_num][idx].token, i))
+        {
+            // A slot freed since the insertion found the bucket full takes the new item directly
+            memcpy(table->buckets[level_num][idx].slot[i].key, key, KEY_LEN);
+            memcpy(table->buckets[level_num][idx].slot[i].value, value, VALUE_LEN);
+            SET_BIT(table->buckets[level_num][idx].token, i, 1);
+            bucket_unlock(&table->buckets[level_num][idx]);
+            return 0;
+        }
+        uint8_t *m_key = table->buckets[level_num][idx].slot[i].key;
+        uint8_t *m_value = table->buckets[level_num][idx].slot[i].value;
+        uint64_t f_hash, s_hash;
+        FS_HASH(level, m_key, &f_hash, &s_hash);
+        uint64_t f_idx = F_IDX(f_hash, table->addr_capacity >> level_num);
+        uint64_t s_idx = S_IDX(s_hash, table->addr_capacity >> level_num);
         
         if(f_idx == idx)
             jdx = s_idx;
         else
             jdx = f_idx;
 
+        if ((level_num == 0 && top_reserved(table, jdx)) || bucket_trylock(&table->buckets[level_num][jdx]))
+            continue;
         for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[level_num][jdx].s_lock[j]);
-            if (level->buckets[level_num][jdx].token[j] == 0)
+            if (!GET_BIT(table->buckets[level_num][jdx].token, j))
             {
-                memcpy(level->buckets[level_num][jdx].slot[j].key, m_key, KEY_LEN);
-                memcpy(level->buckets[level_num][jdx].slot[j].value, m_value, VALUE_LEN);
-                level->buckets[level_num][jdx].token[j] = 1;
-                level->buckets[level_num][idx].token[i] = 0;
-                spin_unlock(&level->level_locks[level_num][jdx].s_lock[j]);
+                memcpy(table->buckets[level_num][jdx].slot[j].key, m_key, KEY_LEN);
+                memcpy(table->buckets[level_num][jdx].slot[j].value, m_value, VALUE_LEN);
+                SET_BIT(table->buckets[level_num][jdx].token, j, 1);
+                bucket_unlock(&table->buckets[level_num][jdx]);
                 // The movement is finished and then the new item is inserted
 
-                memcpy(level->buckets[level_num][idx].slot[i].key, key, KEY_LEN);
-                memcpy(level->buckets[level_num][idx].slot[i].value, value, VALUE_LEN);
-                level->buckets[level_num][idx].token[i] = 1;
-                spin_unlock(&level->level_locks[level_num][idx].s_lock[i]);  
+                memcpy(table->buckets[level_num][idx].slot[i].key, key, KEY_LEN);
+                memcpy(table->buckets[level_num][idx].slot[i].value, value, VALUE_LEN);
+                bucket_unlock(&table->buckets[level_num][idx]);  
 
                 return 0;
             }
-            spin_unlock(&level->level_locks[level_num][jdx].s_lock[j]);
         }
-        spin_unlock(&level->level_locks[level_num][idx].s_lock[i]);        
+        bucket_unlock(&table->buckets[level_num][jdx]);
     }
+    bucket_unlock(&table->buckets[level_num][idx]);        
     
     return 1;
 }
@@ -421,62 +847,65 @@ uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_
 /*
 Function: b2t_movement() 
         Try to move a bottom-level item to its top-level alternative buckets;
+        On success, the bottom-level bucket is still locked by the caller, which puts the new item in the returned slot
 */
-int b2t_movement(level_hash *level, uint64_t idx)
+int b2t_movement(level_hash *level, level_table *table, uint64_t idx)
 {
     uint8_t *key, *value;
     uint64_t s_hash, f_hash;
     uint64_t s_idx, f_idx;
     
-    uint64_t i, j;
+    uint64_t i, j, n;
+    bucket_lock(&table->buckets[1][idx]);
     for(i = 0; i < ASSOC_NUM; i ++){
-        spin_lock(&level->level_locks[1][idx].s_lock[i]);
-        key = level->buckets[1][idx].slot[i].key;
-        value = level->buckets[1][idx].slot[i].value;
-        f_hash = F_HASH(level, key);
-        s_hash = S_HASH(level, key);  
-        f_idx = F_IDX(f_hash, level->addr_capacity);
-        s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-        for(j = 0; j < ASSOC_NUM; j ++){
-            spin_lock(&level->level_locks[0][f_idx].s_lock[j]);
-            if (level->buckets[0][f_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[0][f_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[0][f_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[0][f_idx].token[j] = 1;
-                level->buckets[1][idx].token[i] = 0;
-                spin_unlock(&level->level_locks[0][f_idx].s_lock[j]);
-                return i;
-            }
-            spin_unlock(&level->level_locks[0][f_idx].s_lock[j]);
-            spin_lock(&level->level_locks[0][s_idx].s_lock[j]);
-            if (level->buckets[0][s_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[0][s_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[0][s_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[0][s_idx].token[j] = 1;
-                level->buckets[1][idx].token[i] = 0;
-                spin_unlock(&level->level_locks[0][s_idx].s_lock[j]);
-                return i;
+        if (!GET_BIT(table->buckets[1][idx].token, i))
+        {
+            // A slot freed since the insertion found the bucket full is used directly
+            return i;
+        }
+        key = table->buckets[1][idx].slot[i].key;
+        value = table->buckets[1][idx].slot[i].value;
+        FS_HASH(level, key, &f_hash, &s_hash);
+        f_idx = F_IDX(f_hash, table->addr_capacity);
+        s_idx = S_IDX(s_hash, table->addr_capacity);
+        uint64_t top_idx[2] = {f_idx, s_idx};
+
+        for(n = 0; n < 2; n ++){
+            if (top_reserved(table, top_idx[n]) || bucket_trylock(&table->buckets[0][top_idx[n]]))
+                continue;
+            for(j = 0; j < ASSOC_NUM; j ++){
+                if (!GET_BIT(table->buckets[0][top_idx[n]].token, j))
+                {
+                    memcpy(table->buckets[0][top_idx[n]].slot[j].key, key, KEY_LEN);
+                    memcpy(table->buckets[0][top_idx[n]].slot[j].value, value, VALUE_LEN);
+                    SET_BIT(table->buckets[0][top_idx[n]].token, j, 1);
+                    SET_BIT(table->buckets[1][idx].token, i, 0);
+                    bucket_unlock(&table->buckets[0][top_idx[n]]);
+                    return i;
+                }
             }
-            spin_unlock(&level->level_locks[0][s_idx].s_lock[j]);
+            bucket_unlock(&table->buckets[0][top_idx[n]]);
         }
-        spin_unlock(&level->level_locks[1][idx].s_lock[i]);
     }
+    bucket_unlock(&table->buckets[1][idx]);
 
     return -1;
 }
 
 /*
 Function: level_destroy() 
-        Destroy a level hash table
+        Destroy a level hash table; no other thread may still operate on it
 */
 void level_destroy(level_hash *level)
 {
-    free(level->buckets[0]);
-    free(level->buckets[1]);
-    level = NULL;
+    level_stop_expander(level);
+    pthread_mutex_destroy(&level->expander_mutex);
+    pthread_cond_destroy(&level->expander_cond);
+    level_table *table = level->table;
+    level_free(table->buckets[0], table->addr_capacity*sizeof(level_bucket));
+    level_free(table->buckets[1], (table->addr_capacity >> 1)*sizeof(level_bucket));
+    free(table);
+    free(level);
 }
 
 
@@ -488,9 +917,9 @@ void ycsb_thread_run(void* arg){
     printf("Thread %d is opened\n", subthread->id);
     for(; i < READ_WRITE_NUM/subthread->level->thread_num; i++){
         if( subthread->run_queue[i].operation == 1){
-            if (!level_insert(subthread->level, subthread->run_queue[i].key, subthread->run_queue[i].key)){   
+            // The expansion thread resizes the table while the other threads keep running
+            if (!level_insert(subthread->level, subthread->run_queue[i].key, subthread->run_queue[i].key))
                 subthread->inserted ++;
-            }
         }else{
             if(!level_query(subthread->level, subthread->run_queue[i].key, value))
                 // Get value
@@ -498,4 +927,4 @@ void ycsb_thread_run(void* arg){
         }
     }
     pthread_exit(NULL);
-}
\ No newline at end of file
+}
@@ -6,40 +6,90 @@
 #include <ctype.h>
 #include <math.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "hash.h"
 #include "spinlock.h"
+#include "level_alloc.h"
 
-#define ASSOC_NUM 4                       // The number of slots in a bucket
+#define ASSOC_NUM 4                       // The number of slots in a bucket, should be no more than 8
+
+// Keys are NUL-terminated strings of at most KEY_LEN bytes by default;
+// define BINARY_KEY for binary keys of exactly KEY_LEN bytes, or INTEGER_KEY for 8-byte integer keys
+#ifdef INTEGER_KEY
+#define KEY_LEN 8                         // An integer key is a uint64_t in native byte order
+#else
 #define KEY_LEN 16                        // The maximum length of a key
+#endif
+
 #define VALUE_LEN 15                      // The maximum length of a value
 #define READ_WRITE_NUM 350000             // The total number of read and write operations in the workload
+#define MAX_THREAD_NUM 128                // The maximum number of threads that operate on level hash tables
+#define CACHE_LINE_SIZE 64
+
+#ifndef EXPAND_WATERMARK
+#define EXPAND_WATERMARK 0.75             // The default load factor at which the expansion thread resizes the table
+#endif
+
+#ifndef EXPAND_CHECK_STEP
+#define EXPAND_CHECK_STEP 64              // The number of insertions after which a thread compares the load factor with the watermark
+#endif
+
+// set the n-th bit to 0 or 1
+#define SET_BIT(token, n, bit) (bit ? (token|=(1<<n)) : (token&=~(1<<n)))
+
+// get the n-th bit
+#define GET_BIT(token, n)   (token & (1<<n))
 
 typedef struct entry{                     // A slot storing a key-value item 
     uint8_t key[KEY_LEN];
     uint8_t value[VALUE_LEN];
 } entry;
 
-typedef struct level_bucket               // A bucket
+typedef struct level_bucket               // A bucket, cache-line-aligned and exactly two cache lines long with the default ASSOC_NUM, KEY_LEN and VALUE_LEN
 {
-    uint8_t token[ASSOC_NUM];             // A token indicates whether its corresponding slot is empty, which can also be implemented using 1 bit
+    volatile uint16_t version;            // The version of the bucket, which also serves as the lock of its writers; 
+                                          // odd while a writer modifies the bucket, and readers retry if it changed during their search
+    uint8_t token;                        // Each bit in the last ASSOC_NUM bits indicates whether its corresponding slot is empty
+    uint8_t padding;
     entry slot[ASSOC_NUM];
 } level_bucket;
 
-typedef struct level_locks{
-    spinlock s_lock[ASSOC_NUM];
-} level_locks;
+typedef struct level_table {              // The levels seen by an operation; a resizing publishes a new table instead of modifying this one
+    level_bucket *buckets[3];             // The top level, the bottom level, and the old bottom level being rehashed during resizing (NULL otherwise)
+    uint64_t addr_capacity;               // The number of buckets in the top level; the i-th level has addr_capacity >> i buckets
+    uint64_t total_capacity;              // The number of all buckets in the top and bottom levels
+    uint64_t level_size;                  // level_size = log2(addr_capacity)
+    volatile uint8_t rehash_ready;        // Set once no thread can place an item in the old bottom level any more
+    volatile uint64_t rehash_next;        // The next old-bottom bucket to be rehashed
+} level_table;
+
+typedef struct level_epoch {              // The epoch a thread announced when it entered an operation, 0 when it is outside any operation
+    volatile uint64_t epoch;
+    uint8_t padding[56];                  // One cache line per thread
+} level_epoch;
+
+typedef struct level_counter {            // The number of items a thread inserted minus the number it deleted
+    volatile int64_t item_num;            // Written only by its thread, read by the expansion thread
+    uint8_t padding[56];                  // One cache line per thread
+} level_counter;
 
 typedef struct level_hash {               // A Level hash table
-    level_bucket *buckets[2];             // The top level and bottom level in the Level hash table
-    level_locks* level_locks[2];          // Allocate a fine-grained lock for each slot
+    level_table *volatile table;          // The current levels, read once at the beginning of each operation
 
     uint32_t thread_num;
-    uint64_t addr_capacity;               // The number of buckets in the top level
-    uint64_t total_capacity;              // The number of all buckets in the Level hash table    
-    uint64_t level_size;                  // level_size = log2(addr_capacity)
     uint8_t level_resize;                 // Indicate whether the Level hash table was resized, "1": Yes, "0": No;
+    spinlock resize_lock;                 // Held by the thread performing a resizing
     uint64_t f_seed;
     uint64_t s_seed;                      // Two randomized seeds for hash functions
+    level_alloc_policy alloc_policy;      // How the levels are allocated; set by level_init() to the compile-time defaults and used by later resizing
+
+    level_counter item_counter[MAX_THREAD_NUM];  // The per-thread item counts, indexed like the epochs; their sum approximates the number of items
+    double expand_watermark;              // The load factor at which the expansion thread resizes the table, EXPAND_WATERMARK by default
+    volatile uint64_t expand_threshold;   // The number of items at which the expansion thread resizes the current table
+    volatile uint8_t expander_running;    // Indicate whether the expansion thread is running, "1": Yes, "0": No;
+    pthread_t expander;                   // The expansion thread started by level_start_expander()
+    pthread_mutex_t expander_mutex;
+    pthread_cond_t expander_cond;         // Signaled when the load factor reaches the watermark, the expansion thread sleeps on it otherwise
 } level_hash;
 
 typedef struct thread_queue{
@@ -66,11 +116,21 @@ uint8_t level_delete(level_hash *level, uint8_t*key);
 
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value);
 
-void level_resize(level_hash *level);
+uint8_t level_resize(level_hash *level);
+
+uint8_t level_resize_start(level_hash *level);
+
+void level_resize_finish(level_hash *level);
+
+uint64_t level_item_num(level_hash *level);
+
+void level_start_expander(level_hash *level);
+
+void level_stop_expander(level_hash *level);
 
-uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value);
+uint8_t try_movement(level_hash *level, level_table *table, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value);
 
-int b2t_movement(level_hash *level, uint64_t idx);
+int b2t_movement(level_hash *level, level_table *table, uint64_t idx);
 
 void level_destroy(level_hash *level);
 
@@ -0,0 +1,154 @@
+#include "level_hashing.h"
+
+typedef struct test_thread {
+    pthread_t thread;
+    uint32_t id;
+    uint32_t thread_num;
+    uint64_t insert_num;
+    uint64_t error_num;
+    level_hash *level;
+} test_thread;
+
+/*
+Function: test_key() 
+        Write the i-th key of the test
+*/
+static void test_key(uint8_t *key, uint64_t i)
+{
+    memset(key, 0, KEY_LEN);
+    snprintf(key, KEY_LEN, "%ld", i);
+}
+
+/*
+Function: test_thread_run() 
+        Insert the keys of one thread, each searched right after its insertion and a few of the
+        keys inserted earlier searched as well, while the expansion thread resizes the table
+*/
+static void *test_thread_run(void *arg)
+{
+    test_thread *t = arg;
+    uint8_t key[KEY_LEN], value[VALUE_LEN];
+    uint64_t i;
+    for (i = t->id + 1; i < t->insert_num + 1; i += t->thread_num)
+    {
+        test_key(key, i);
+        if (level_insert(t->level, key, key))
+        {
+            printf("Insert the key %s: ERROR! \n", key);
+            t->error_num ++;
+        }
+        if (level_query(t->level, key, value) || strncmp(value, key, VALUE_LEN))
+        {
+            printf("Search the key %s after inserting it: ERROR! \n", key);
+            t->error_num ++;
+        }
+        test_key(key, i / 2 + 1);
+        if ((i / 2) % t->thread_num == t->id && level_query(t->level, key, value))
+        {
+            printf("Search the key %s inserted earlier: ERROR! \n", key);
+            t->error_num ++;
+        }
+    }
+    return NULL;
+}
+
+/*
+Function: test_full_resize() 
+        Fill a table until an insertion fails, start a resizing, and insert new keys before the old bottom level is
+        rehashed; the new keys must leave the rehashed items room, so that the resizing finishes and no key is lost;
+        Return the number of errors
+*/
+static uint64_t test_full_resize(int level_size)
+{
+    level_hash *level = level_init(level_size);
+    uint8_t key[KEY_LEN], value[VALUE_LEN];
+    uint64_t i, old_num, new_num = 0, error_num = 0;
+    for (old_num = 1; ; old_num ++)
+    {
+        test_key(key, old_num);
+        if (level_insert(level, key, key))
+            break;
+    }
+
+    level_resize_start(level);
+    uint64_t try_num = level->table->addr_capacity*ASSOC_NUM*16;
+    uint8_t *inserted = calloc(try_num, 1);
+    for (i = 0; i < try_num; i ++)
+    {
+        test_key(key, old_num + 1 + i);
+        if (!level_insert(level, key, key))
+        {
+            inserted[i] = 1;
+            new_num ++;
+        }
+    }
+    level_resize_finish(level);
+    printf("%ld new keys were inserted into the full table before its old bottom level was rehashed\n", new_num);
+
+    for (i = 1; i < old_num + 1 + try_num; i ++)
+    {
+        if (i == old_num || (i > old_num && !inserted[i - old_num - 1]))
+            continue;
+        test_key(key, i);
+        if (level_query(level, key, value) || strncmp(value, key, VALUE_LEN))
+        {
+            printf("Search the key %s after the resizing: ERROR! \n", key);
+            error_num ++;
+        }
+    }
+    free(inserted);
+    level_destroy(level);
+    return error_num;
+}
+
+/*  Test:
+    Insert new keys into a full table being resized, then let several threads insert and search keys 
+    while the expansion thread resizes the table close to full load
+*/
+int main(int argc, char* argv[])
+{
+    int thread_num = atoi(argv[1]);                     // INPUT: the number of threads
+    int level_size = atoi(argv[2]);                     // INPUT: the number of addressable buckets is 2^level_size
+    int insert_num = atoi(argv[3]);                     // INPUT: the number of items to be inserted
+
+    test_full_resize(level_size);
+
+    level_hash *level = level_init(level_size);
+    level->thread_num = thread_num;
+    level->expand_watermark = 0.95;                     // Resize close to full load, where the rehashed items need most of the room
+    level_start_expander(level);
+
+    test_thread *threads = malloc(sizeof(test_thread)*thread_num);
+    uint64_t t, i, error_num = 0;
+    for (t = 0; t < thread_num; t ++)
+    {
+        threads[t].id = t;
+        threads[t].thread_num = thread_num;
+        threads[t].insert_num = insert_num;
+        threads[t].error_num = 0;
+        threads[t].level = level;
+        pthread_create(&threads[t].thread, NULL, test_thread_run, &threads[t]);
+    }
+    for (t = 0; t < thread_num; t ++)
+    {
+        pthread_join(threads[t].thread, NULL);
+        error_num += threads[t].error_num;
+    }
+    level_stop_expander(level);
+    printf("%d threads inserted %d items with %d resizings\n", thread_num, insert_num, level->level_resize);
+
+    uint8_t key[KEY_LEN], value[VALUE_LEN];
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        test_key(key, i);
+        if (level_query(level, key, value))
+            printf("Search the key %s: ERROR! \n", key);
+        if (i % 2 && level_delete(level, key))
+            printf("Delete the key %s: ERROR! \n", key);
+    }
+    printf("The approximate number of items: %ld\n", level_item_num(level));
+
+    free(threads);
+    level_destroy(level);
+    return 0;
+}
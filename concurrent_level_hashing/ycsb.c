@@ -10,8 +10,9 @@ int main(int argc, char* argv[])
 
     level_hash *level = level_init(19);
     level->thread_num = thread_num;
+    level_start_expander(level);                // The table is expanded in the background, so insertions never fail
     uint64_t inserted = 0, queried = 0, t = 0;
-    uint8_t key[KEY_LEN];
+    uint8_t key[KEY_LEN] = {0};
     uint8_t value[VALUE_LEN];
 
 	FILE *ycsb, *ycsb_read;
@@ -29,13 +30,8 @@ int main(int argc, char* argv[])
 	while(getline(&buf,&len,ycsb) != -1){
 		if(strncmp(buf, "INSERT", 6) == 0){
 			memcpy(key, buf+7, KEY_LEN-1);
-			if (!level_insert(level, key, key))                      
-			{
+			if (!level_insert(level, key, key))
 				inserted ++;
-			}
-			else{
-				break;
-			}
 		}
 	}
 	fclose(ycsb);
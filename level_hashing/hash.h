@@ -9,4 +9,16 @@ Function: hash()
 */
 uint64_t hash(const void *data, uint64_t length, uint64_t seed);
 
+/*
+Function: hash_128() 
+        This function computes two 64-bit hash values of a string key in a single pass,
+        hash_value[0] with the seed f_seed and hash_value[1] with the seed s_seed
+*/
+void hash_128(const void *data, uint64_t length, uint64_t f_seed, uint64_t s_seed, uint64_t *hash_value);
 
+/*
+Function: hash_integer() 
+        This function computes two different and independent hash values of an 8-byte integer key,
+        hash_value[0] with the seed f_seed and hash_value[1] with the seed s_seed
+*/
+void hash_integer(uint64_t key, uint64_t f_seed, uint64_t s_seed, uint64_t *hash_value);
@@ -0,0 +1,49 @@
+#include <stdint.h>
+
+#define HUGE_PAGE_SIZE (2UL << 20)        // The size of a transparent or hugetlbfs huge page
+
+#define LEVEL_NUMA_DEFAULT 0              // The pages of a level are placed on the node of the thread first touching them
+#define LEVEL_NUMA_INTERLEAVE 1           // The pages of a level are interleaved over all nodes
+#define LEVEL_NUMA_LOCAL 2                // The pages of a level are placed on one node
+
+#ifndef LEVEL_HUGE_PAGE
+#define LEVEL_HUGE_PAGE 1                 // Back the levels with huge pages by default
+#endif
+
+#ifndef LEVEL_NUMA_POLICY
+#define LEVEL_NUMA_POLICY LEVEL_NUMA_DEFAULT
+#endif
+
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE (1UL << 20)      // The size of the chunks that an arena carves into records
+#endif
+
+#define ARENA_GRAIN 16                    // Records are rounded up to a multiple of ARENA_GRAIN bytes, which is also their alignment
+#define ARENA_MAX_RECORD 512              // Larger records are allocated by malloc()
+#define ARENA_CLASS_NUM (ARENA_MAX_RECORD / ARENA_GRAIN)
+
+typedef struct level_arena {              // An allocator of small records carved from large chunks, with a free list per size class
+    uint8_t *free_list[ARENA_CLASS_NUM];  // The freed records of each size class, linked through their first 8 bytes
+    uint8_t *chunk;                       // The chunk being carved, whose first 8 bytes link the previous chunk
+    uint64_t chunk_used;                  // The number of bytes carved from the chunk
+} level_arena;
+
+typedef struct level_alloc_policy {       // How the bucket arrays of the levels are allocated
+    uint8_t huge_page;                    // "1": back a level with hugetlbfs pages, or transparent huge pages when none are reserved; "0": use normal pages
+    uint8_t numa_policy;                  // LEVEL_NUMA_DEFAULT, LEVEL_NUMA_INTERLEAVE or LEVEL_NUMA_LOCAL
+    int numa_node;                        // The node used by LEVEL_NUMA_LOCAL, or -1 for the node of the allocating thread
+} level_alloc_policy;
+
+void level_alloc_policy_init(level_alloc_policy *policy);
+
+void *level_alloc(level_alloc_policy *policy, uint64_t size);
+
+void level_free(void *addr, uint64_t size);
+
+void level_arena_init(level_arena *arena);
+
+void *level_arena_alloc(level_arena *arena, uint64_t size);
+
+void level_arena_free(level_arena *arena, void *record, uint64_t size);
+
+void level_arena_destroy(level_arena *arena);
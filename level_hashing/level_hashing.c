@@ -1,19 +1,149 @@
 #include "level_hashing.h"
 
 /*
-Function: F_HASH()
-        Compute the first hash value of a key-value item
+Function: KEY_SIZE()
+        Return the length of a key passed to the functions taking fixed-size keys
 */
-uint64_t F_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->f_seed));
+static inline uint32_t KEY_SIZE(const uint8_t *key) {
+#if defined(INTEGER_KEY) || defined(BINARY_KEY)
+    return KEY_LEN;
+#else
+    return strlen(key);
+#endif
 }
 
 /*
-Function: S_HASH() 
-        Compute the second hash value of a key-value item
+Function: FS_HASH()
+        Compute the first and second hash values of a key-value item in a single pass
 */
-uint64_t S_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->s_seed));
+void FS_HASH(level_hash *level, const uint8_t *key, uint32_t key_len, uint64_t *f_hash, uint64_t *s_hash) {
+    uint64_t hash_value[2];
+#if defined(INTEGER_KEY)
+    uint64_t int_key;
+    memcpy(&int_key, key, sizeof(uint64_t));
+    hash_integer(int_key, level->f_seed, level->s_seed, hash_value);
+#else
+    hash_128((void *)key, key_len, level->f_seed, level->s_seed, hash_value);
+#endif
+    *f_hash = hash_value[0];
+    *s_hash = hash_value[1];
+}
+
+/*
+Function: KEY_EQUAL()
+        Determine whether two keys are equal according to the type of keys;
+*/
+static inline int KEY_EQUAL(const uint8_t *key1, const uint8_t *key2) {
+#if defined(INTEGER_KEY)
+    uint64_t int_key1, int_key2;
+    memcpy(&int_key1, key1, sizeof(uint64_t));
+    memcpy(&int_key2, key2, sizeof(uint64_t));
+    return int_key1 == int_key2;
+#elif defined(BINARY_KEY)
+    return memcmp(key1, key2, KEY_LEN) == 0;
+#else
+    return strcmp(key1, key2) == 0;
+#endif
+}
+
+/*
+Function: entry_set()
+        Fill an item with a key and a value; with VAR_ITEM, an item that does not fit in INLINE_LEN bytes 
+        is copied into a record allocated out of line from the arena of the table
+*/
+static inline void entry_set(level_hash *level, entry *item, uint8_t *key, uint32_t key_len, uint8_t *value, uint32_t value_len)
+{
+#ifdef VAR_ITEM
+    if (key_len + value_len <= INLINE_LEN)
+    {
+        item->key_len = key_len;
+        item->value_len = value_len;
+        memcpy(item->data, key, key_len);
+        memcpy(item->data + key_len, value, value_len);
+        return;
+    }
+    item->key_len = OUTLINE_ITEM;
+    item->outline.key_len = key_len;
+    item->outline.value_len = value_len;
+    item->outline.data = level_arena_alloc(&level->arena, (uint64_t)key_len + value_len);
+    if (!item->outline.data)
+    {
+        printf("The item allocation fails\n");
+        exit(1);
+    }
+    memcpy(item->outline.data, key, key_len);
+    memcpy(item->outline.data + key_len, value, value_len);
+#else
+    memcpy(item->key, key, KEY_LEN);
+    memcpy(item->value, value, VALUE_LEN);
+#endif
+}
+
+/*
+Function: entry_free()
+        Release the out-of-line record of an item that is removed from the table
+*/
+static inline void entry_free(level_hash *level, entry *item)
+{
+#ifdef VAR_ITEM
+    if (item->key_len == OUTLINE_ITEM)
+        level_arena_free(&level->arena, item->outline.data, (uint64_t)item->outline.key_len + item->outline.value_len);
+#endif
+}
+
+/*
+Function: entry_key()
+        Return the key of an item and set its length
+*/
+static inline uint8_t *entry_key(entry *item, uint32_t *key_len)
+{
+#ifdef VAR_ITEM
+    if (item->key_len == OUTLINE_ITEM)
+    {
+        *key_len = item->outline.key_len;
+        return item->outline.data;
+    }
+    *key_len = item->key_len;
+    return item->data;
+#else
+    *key_len = KEY_SIZE(item->key);
+    return item->key;
+#endif
+}
+
+/*
+Function: entry_value()
+        Return the value of an item and set its length
+*/
+static inline uint8_t *entry_value(entry *item, uint32_t *value_len)
+{
+#ifdef VAR_ITEM
+    if (item->key_len == OUTLINE_ITEM)
+    {
+        *value_len = item->outline.value_len;
+        return item->outline.data + item->outline.key_len;
+    }
+    *value_len = item->value_len;
+    return item->data + item->key_len;
+#else
+    *value_len = VALUE_LEN;
+    return item->value;
+#endif
+}
+
+/*
+Function: ENTRY_KEY_EQUAL()
+        Determine whether the key of an item equals a key
+*/
+static inline int ENTRY_KEY_EQUAL(entry *item, const uint8_t *key, uint32_t key_len)
+{
+#ifdef VAR_ITEM
+    uint32_t item_key_len;
+    uint8_t *item_key = entry_key(item, &item_key_len);
+    return item_key_len == key_len && memcmp(item_key, key, key_len) == 0;
+#else
+    return KEY_EQUAL(item->key, key);
+#endif
 }
 
 /*
@@ -21,7 +151,7 @@ Function: F_IDX()
         Compute the second hash location
 */
 uint64_t F_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2);
+    return hashKey & (capacity / 2 - 1);
 }
 
 /*
@@ -29,9 +159,233 @@ Function: S_IDX()
         Compute the second hash location
 */
 uint64_t S_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2) + capacity / 2;
+    return (hashKey & (capacity / 2 - 1)) + capacity / 2;
+}
+
+/*
+Function: KEY_FP()
+        Compute the fingerprint of a key from the high bits of its first hash value,
+        which are not used by the hash locations; 0 is reserved for empty slots
+*/
+uint8_t KEY_FP(uint64_t hashKey) {
+    uint8_t fp = hashKey >> 56;
+    return fp ? fp : 1;
+}
+
+/*
+Function: bucket_match()
+        Return a bitmap of the slots in a bucket whose tokens equal the fingerprint;
+        All the tokens of the bucket are compared at once with SSE2 when it is available
+*/
+static inline uint32_t bucket_match(level_bucket *bucket, uint8_t fp)
+{
+#if defined(__SSE2__) && ASSOC_NUM <= 16
+    __m128i tokens = _mm_setzero_si128();
+    memcpy(&tokens, bucket->token, ASSOC_NUM);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(tokens, _mm_set1_epi8(fp))) & ((1U << ASSOC_NUM) - 1);
+#else
+    uint32_t match = 0, j;
+    for(j = 0; j < ASSOC_NUM; j ++){
+        if (bucket->token[j] == fp)
+            match |= 1U << j;
+    }
+    return match;
+#endif
+}
+
+/*
+Function: bucket_find()
+        Return the slot storing a key in a bucket, or -1 if the key is not in the bucket;
+        Only the keys in the slots with matching fingerprints are compared
+*/
+static inline int bucket_find(level_bucket *bucket, uint8_t fp, uint8_t *key, uint32_t key_len)
+{
+    uint32_t match = bucket_match(bucket, fp);
+    while (match) {
+        int j = __builtin_ctz(match);
+        if (ENTRY_KEY_EQUAL(&bucket->slot[j], key, key_len))
+            return j;
+        match &= match - 1;
+    }
+    return -1;
 }
 
+// Prefetch both cache lines a bucket may span, for reading (rw = 0) or writing (rw = 1)
+#define PREFETCH_BUCKET(bucket, rw) do {                           \
+        __builtin_prefetch((bucket), (rw), 0);                      \
+        __builtin_prefetch((uint8_t *)((bucket) + 1) - 1, (rw), 0); \
+    } while (0)
+
+/*
+Function: level_search_pair()
+        Find a key in its two candidate buckets of level i; return its slot or NULL
+*/
+static inline entry* level_search_pair(level_hash *level, uint64_t i, uint8_t *key, uint32_t key_len, uint8_t fp, uint64_t f_hash, uint64_t s_hash)
+{
+    level_bucket *bucket = &level->buckets[i][F_IDX(f_hash, level->addr_capacity >> i)];
+    int j = bucket_find(bucket, fp, key, key_len);
+    if (j != -1)
+        return &bucket->slot[j];
+    bucket = &level->buckets[i][S_IDX(s_hash, level->addr_capacity >> i)];
+    j = bucket_find(bucket, fp, key, key_len);
+    if (j != -1)
+        return &bucket->slot[j];
+    return NULL;
+}
+
+/*
+Function: level_search_migrating()
+        Find a key in the old bottom level during an incremental expansion; return its slot or NULL;
+        The buckets already migrated are empty and not read
+*/
+static inline entry* level_search_migrating(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t fp, uint64_t f_hash, uint64_t s_hash)
+{
+    if (level->buckets[2] == NULL)
+        return NULL;
+    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity >> 2);
+    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity >> 2);
+    int j;
+    if (f_idx >= level->migrate_next && (j = bucket_find(&level->buckets[2][f_idx], fp, key, key_len)) != -1)
+        return &level->buckets[2][f_idx].slot[j];
+    if (s_idx >= level->migrate_next && (j = bucket_find(&level->buckets[2][s_idx], fp, key, key_len)) != -1)
+        return &level->buckets[2][s_idx].slot[j];
+    return NULL;
+}
+
+// The bit of the stash hint covering the keys whose second hash value is s_hash; its top 6 bits are used by
+// neither the hash locations, taken from the low bits, nor the fingerprint, taken from the first hash value
+#define STASH_HINT(s_hash) (1ULL << ((s_hash) >> 58))
+
+/*
+Function: level_stash_find()
+        Return the position of a key in the stash, or -1 if it is not stashed;
+        The stash is read only if the hint bit of the key is set, which is never the case while it is empty
+*/
+static inline int level_stash_find(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t fp, uint64_t s_hash)
+{
+    if (!(level->stash_hint & STASH_HINT(s_hash)))
+        return -1;
+    uint32_t i;
+    for (i = 0; i < level->stash_num; i ++) {
+        if (level->stash[i].fp == fp && ENTRY_KEY_EQUAL(&level->stash[i].item, key, key_len))
+            return i;
+    }
+    return -1;
+}
+
+/*
+Function: level_stash_search()
+        Find a key in the stash; return its slot or NULL
+*/
+static inline entry* level_stash_search(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t fp, uint64_t s_hash)
+{
+    int i = level_stash_find(level, key, key_len, fp, s_hash);
+    return i == -1 ? NULL : &level->stash[i].item;
+}
+
+/*
+Function: level_stash_put()
+        Keep an item that found no slot in the stash; return 1 if the stash is full
+*/
+static uint8_t level_stash_put(level_hash *level, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp)
+{
+    if (level->stash_num == STASH_SIZE)
+        return 1;
+    level_stash_item *stashed = &level->stash[level->stash_num ++];
+    stashed->item = *item;
+    stashed->f_hash = f_hash;
+    stashed->s_hash = s_hash;
+    stashed->fp = fp;
+    level->stash_hint |= STASH_HINT(s_hash);
+    return 0;
+}
+
+/*
+Function: level_stash_remove()
+        Remove the i-th item from the stash and rebuild the hint from the remaining items
+*/
+static void level_stash_remove(level_hash *level, uint32_t i)
+{
+    level->stash[i] = level->stash[-- level->stash_num];
+    level->stash_hint = 0;
+    for (i = 0; i < level->stash_num; i ++)
+        level->stash_hint |= STASH_HINT(level->stash[i].s_hash);
+}
+
+/*
+Function: SLOT_HASH()
+        Get the hash values of the item in the j-th slot of a bucket, from its hash tags if they are stored
+*/
+static inline void SLOT_HASH(level_hash *level, level_bucket *bucket, uint64_t j, uint64_t *f_hash, uint64_t *s_hash)
+{
+#ifdef HASH_TAG
+    *f_hash = bucket->f_tag[j];
+    *s_hash = bucket->s_tag[j];
+#else
+    uint32_t key_len;
+    uint8_t *key = entry_key(&bucket->slot[j], &key_len);
+    FS_HASH(level, key, key_len, f_hash, s_hash);
+#endif
+}
+
+/*
+Function: slot_store()
+        Write an item and the hash tags of its hash values into the j-th slot of a bucket;
+        The caller sets the token of the slot
+*/
+static inline void slot_store(level_bucket *bucket, uint64_t j, entry *item, uint64_t f_hash, uint64_t s_hash)
+{
+    bucket->slot[j] = *item;
+#ifdef HASH_TAG
+    bucket->f_tag[j] = f_hash;
+    bucket->s_tag[j] = s_hash;
+#endif
+}
+
+/*
+Function: bucket_less_loaded() 
+        Return whichever of two buckets has more empty slots, the first one on a tie
+*/
+static inline level_bucket *bucket_less_loaded(level_bucket *f_bucket, level_bucket *s_bucket)
+{
+    return __builtin_popcount(bucket_match(s_bucket, 0)) > __builtin_popcount(bucket_match(f_bucket, 0)) ? s_bucket : f_bucket;
+}
+
+/*
+Function: bucket_choose() 
+        Return the bucket an item goes to between its two candidate buckets: the less-loaded one, or without 
+        least_loaded, the one whose first empty slot comes first, the first bucket on a tie
+*/
+static inline level_bucket *bucket_choose(level_hash *level, level_bucket *f_bucket, level_bucket *s_bucket)
+{
+    if (level->least_loaded)
+        return bucket_less_loaded(f_bucket, s_bucket);
+    uint32_t f_empty = bucket_match(f_bucket, 0);
+    uint32_t s_empty = bucket_match(s_bucket, 0);
+    return !f_empty || (s_empty && __builtin_ctz(s_empty) < __builtin_ctz(f_empty)) ? s_bucket : f_bucket;
+}
+
+/*
+Function: level_store_pair() 
+        Store an item into an empty slot of the bucket bucket_choose() picks between its two candidate buckets of level i;
+        Return 1 if both buckets are full
+*/
+static inline uint8_t level_store_pair(level_hash *level, uint64_t i, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp)
+{
+    level_bucket *bucket = bucket_choose(level, &level->buckets[i][F_IDX(f_hash, level->addr_capacity >> i)],
+        &level->buckets[i][S_IDX(s_hash, level->addr_capacity >> i)]);
+    uint32_t empty = bucket_match(bucket, 0);
+    if (!empty)
+        return 1;
+
+    uint64_t j = __builtin_ctz(empty);
+    slot_store(bucket, j, item, f_hash, s_hash);
+    bucket->token[j] = fp;
+    level->level_item_num[i] ++;
+    return 0;
+}
+
+static uint8_t level_insert_item(level_hash *level, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp);
 
 void* alignedmalloc(size_t size) {
   void* ret;
@@ -56,10 +410,11 @@ void generate_seeds(level_hash *level)
 }
 
 /*
-Function: level_init() 
-        Initialize a level hash table
+Function: level_init_seeds() 
+        Initialize a level hash table whose hash functions use the given seeds, without printing its parameters,
+        e.g., for one of many tables seeded from a single source
 */
-level_hash *level_init(uint64_t level_size)
+level_hash *level_init_seeds(uint64_t level_size, uint64_t f_seed, uint64_t s_seed)
 {
     level_hash *level = alignedmalloc(sizeof(level_hash));
     if (!level)
@@ -71,19 +426,53 @@ level_hash *level_init(uint64_t level_size)
     level->level_size = level_size;
     level->addr_capacity = pow(2, level_size);
     level->total_capacity = pow(2, level_size) + pow(2, level_size - 1);
-    generate_seeds(level);
-    level->buckets[0] = alignedmalloc(pow(2, level_size)*sizeof(level_bucket));
-    level->buckets[1] = alignedmalloc(pow(2, level_size - 1)*sizeof(level_bucket));
+    level->f_seed = f_seed;
+    level->s_seed = s_seed;
+    level_alloc_policy_init(&level->alloc_policy);
+#ifdef VAR_ITEM
+    level_arena_init(&level->arena);
+#endif
+    level->buckets[0] = level_alloc(&level->alloc_policy, pow(2, level_size)*sizeof(level_bucket));
+    level->buckets[1] = level_alloc(&level->alloc_policy, pow(2, level_size - 1)*sizeof(level_bucket));
+    level->buckets[2] = NULL;
     level->level_item_num[0] = 0;
     level->level_item_num[1] = 0;
+    level->level_item_num[2] = 0;
     level->level_expand_time = 0;
     level->resize_state = 0;
+    level->expand_thread_num = EXPAND_THREAD_NUM;
+    memset(&level->expand_stats, 0, sizeof(level_expand_stats));
+    level->incremental_expand = INCREMENTAL_EXPAND;
+    level->migrate_bucket_num = MIGRATE_BUCKET_NUM;
+    level->migrate_next = 0;
+    level->displace_depth = DISPLACE_DEPTH;
+    level->least_loaded = LEAST_LOADED;
+    level->stash_num = 0;
+    level->stash_hint = 0;
+    level->auto_resize = 0;
+    level->grow_watermark = GROW_WATERMARK;
+    level->shrink_watermark = SHRINK_WATERMARK;
+    level->min_level_size = level_size;
+    level->prefault_watermark = PREFAULT_WATERMARK;
+    level->prefault_state = 0;
+    level->prefault_buckets = NULL;
     
     if (!level->buckets[0] || !level->buckets[1])
     {
         printf("The level hash table initialization fails:2\n");
         exit(1);
     }
+    return level;
+}
+
+/*
+Function: level_init() 
+        Initialize a level hash table
+*/
+level_hash *level_init(uint64_t level_size)
+{
+    level_hash *level = level_init_seeds(level_size, 0, 0);
+    generate_seeds(level);
 
     printf("Level hashing: ASSOC_NUM %d, KEY_LEN %d, VALUE_LEN %d \n", ASSOC_NUM, KEY_LEN, VALUE_LEN);
     printf("The number of top-level buckets: %ld\n", level->addr_capacity);
@@ -93,11 +482,201 @@ level_hash *level_init(uint64_t level_size)
     return level;
 }
 
+/*
+Function: level_elapsed() 
+        Return the seconds elapsed since start
+*/
+static double level_elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/*
+Function: level_prefault()
+        Allocate the next top level and touch all its pages, so that the expansion neither
+        allocates nor page-faults it; run by the prefault thread
+*/
+static void *level_prefault(void *arg)
+{
+    level_hash *level = arg;
+    uint64_t size = level->prefault_capacity*sizeof(level_bucket);
+    volatile uint8_t *buckets = level_alloc(&level->alloc_policy, size);
+    uint64_t off;
+    if (buckets) {
+        for (off = 0; off < size; off += 4096)
+            buckets[off] = 0;
+    }
+    level->prefault_buckets = (level_bucket *)buckets;
+    return NULL;
+}
+
+/*
+Function: level_prefault_check()
+        Start the prefault thread once the load factor reaches the prefault watermark
+*/
+static inline void level_prefault_check(level_hash *level)
+{
+    if (level->prefault_state || level->prefault_watermark <= 0 ||
+        level->level_item_num[0] + level->level_item_num[1] + level->level_item_num[2] < level->total_capacity*ASSOC_NUM*level->prefault_watermark)
+        return;
+
+    level->prefault_capacity = level->addr_capacity*2;
+    level->prefault_buckets = NULL;
+    if (pthread_create(&level->prefault_thread, NULL, level_prefault, level) == 0)
+        level->prefault_state = 1;
+    else
+        level->prefault_watermark = 0;    // Without threads, the expansion allocates the level itself
+}
+
+/*
+Function: level_prefault_take()
+        Wait for the prefault thread and return its level if it has bucket_num buckets;
+        Otherwise free it and return NULL
+*/
+static level_bucket *level_prefault_take(level_hash *level, uint64_t bucket_num)
+{
+    if (!level->prefault_state)
+        return NULL;
+    pthread_join(level->prefault_thread, NULL);
+    level->prefault_state = 0;
+
+    level_bucket *buckets = level->prefault_buckets;
+    level->prefault_buckets = NULL;
+    if (buckets && level->prefault_capacity != bucket_num) {
+        level_free(buckets, level->prefault_capacity*sizeof(level_bucket));
+        buckets = NULL;
+    }
+    return buckets;
+}
+
+typedef struct expand_task {              // A range of bottom-level buckets rehashed by one thread during an expansion
+    level_hash *level;
+    level_bucket *new_buckets;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t item_num;                    // The number of items the thread rehashed into the new level
+} expand_task;
+
+/*
+Function: level_expand_rehash() 
+        Rehash the items in a range of bottom-level buckets into the new level;
+        Threads rehashing other ranges may target the same new buckets, so a slot is claimed 
+        by atomically setting its token before the item is copied
+*/
+static void *level_expand_rehash(void *arg)
+{
+    expand_task *task = arg;
+    level_hash *level = task->level;
+    level_bucket *newBuckets = task->new_buckets;
+    uint64_t old_idx;
+
+    for (old_idx = task->begin; old_idx < task->end; old_idx ++) {
+        uint64_t i, j;
+        for(i = 0; i < ASSOC_NUM; i ++){
+            if (level->buckets[1][old_idx].token[i] != 0)
+            {
+                entry *item = &level->buckets[1][old_idx].slot[i];
+                uint64_t f_hash, s_hash;
+                SLOT_HASH(level, &level->buckets[1][old_idx], i, &f_hash, &s_hash);
+                uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
+                uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
+
+                /*  The rehashed item is inserted into the bucket bucket_choose() picks between 
+                    the two hash locations in the new level; another thread may fill
+                    that bucket meanwhile, so the other bucket is tried next
+                */
+                level_bucket *pair[2] = {&newBuckets[f_idx], &newBuckets[s_idx]};
+                if (bucket_choose(level, pair[0], pair[1]) == pair[1]) {
+                    pair[1] = pair[0];
+                    pair[0] = &newBuckets[s_idx];
+                }
+                uint8_t insertSuccess = 0;
+                uint64_t b;
+                for(b = 0; b < 2 && !insertSuccess; b ++){
+                    for(j = 0; j < ASSOC_NUM; j ++){
+                        if (pair[b]->token[j] == 0 && __sync_bool_compare_and_swap(&pair[b]->token[j], 0, level->buckets[1][old_idx].token[i]))
+                        {
+                            slot_store(pair[b], j, item, f_hash, s_hash);
+                            insertSuccess = 1;
+                            task->item_num ++;
+                            break;
+                        }
+                    }
+                }
+                if(!insertSuccess){
+                    printf("The expanding fails: 3\n");
+                    exit(1);                    
+                }
+                
+                level->buckets[1][old_idx].token[i] = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Function: level_stash_drain() 
+        Insert the stashed items again after an expansion has made room for them
+*/
+static void level_stash_drain(level_hash *level)
+{
+    level_stash_item stash[STASH_SIZE];
+    uint32_t i, stash_num = level->stash_num;
+    memcpy(stash, level->stash, stash_num*sizeof(level_stash_item));
+    level->stash_num = 0;
+    level->stash_hint = 0;
+    // An item still finding no slot goes back to the stash, which has room for all of them
+    for (i = 0; i < stash_num; i ++)
+        level_insert_item(level, &stash[i].item, stash[i].f_hash, stash[i].s_hash, stash[i].fp);
+}
+
+/*
+Function: level_migrate() 
+        Migrate up to bucket_num buckets of the old bottom level into the top and bottom levels during
+        an incremental expansion, and free the old bottom level once all its buckets are migrated
+*/
+static void level_migrate(level_hash *level, uint64_t bucket_num)
+{
+    if (level->buckets[2] == NULL)
+        return;
+
+    uint64_t old_num = level->addr_capacity >> 2;
+    uint64_t end = bucket_num < old_num - level->migrate_next ? level->migrate_next + bucket_num : old_num;
+    uint64_t i;
+    for (; level->migrate_next < end; level->migrate_next ++) {
+        level_bucket *bucket = &level->buckets[2][level->migrate_next];
+        for(i = 0; i < ASSOC_NUM; i ++){
+            if (bucket->token[i] != 0)
+            {
+                uint64_t f_hash, s_hash;
+                SLOT_HASH(level, bucket, i, &f_hash, &s_hash);
+                if (level_insert_item(level, &bucket->slot[i], f_hash, s_hash, bucket->token[i])) {
+                    printf("The expanding fails: 3\n");
+                    exit(1);
+                }
+                bucket->token[i] = 0;
+                level->level_item_num[2] --;
+            }
+        }
+    }
+
+    if (level->migrate_next == old_num) {
+        level_free(level->buckets[2], old_num*sizeof(level_bucket));
+        level->buckets[2] = NULL;
+        level->resize_state = 0;
+    }
+}
+
 /*
 Function: level_expand()
         Expand a level hash table in place;
         Put a new level on top of the old hash table and only rehash the
         items in the bottom level of the old hash table;
+        The bottom level is split into expand_thread_num ranges rehashed in parallel;
+        With incremental_expand, the bottom level becomes the old bottom level migrated by the next operations instead
 */
 void level_expand(level_hash *level) 
 {
@@ -106,65 +685,79 @@ void level_expand(level_hash *level)
         printf("The expanding fails: 1\n");
         exit(1);
     }
+    // The previous incremental expansion is finished first, so that there are at most three levels
+    level_migrate(level, level->addr_capacity);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     level->resize_state = 1;
     level->addr_capacity = pow(2, level->level_size + 1);
-    level_bucket *newBuckets = alignedmalloc(level->addr_capacity*sizeof(level_bucket));
+    level_bucket *newBuckets = level_prefault_take(level, level->addr_capacity);
+    if (!newBuckets)
+        newBuckets = level_alloc(&level->alloc_policy, level->addr_capacity*sizeof(level_bucket));
     if (!newBuckets) {
         printf("The expanding fails: 2\n");
         exit(1);
     }
-    uint64_t new_level_item_num = 0;
-    
-    uint64_t old_idx;
-    for (old_idx = 0; old_idx < pow(2, level->level_size - 1); old_idx ++) {
-        uint64_t i, j;
-        for(i = 0; i < ASSOC_NUM; i ++){
-            if (level->buckets[1][old_idx].token[i] == 1)
-            {
-                uint8_t *key = level->buckets[1][old_idx].slot[i].key;
-                uint8_t *value = level->buckets[1][old_idx].slot[i].value;
+    level->expand_stats.alloc_time = level_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (level->incremental_expand)
+    {
+        level->level_size ++;
+        level->total_capacity = pow(2, level->level_size) + pow(2, level->level_size - 1);
+        level->buckets[2] = level->buckets[1];
+        level->buckets[1] = level->buckets[0];
+        level->buckets[0] = newBuckets;
+        level->level_item_num[2] = level->level_item_num[1];
+        level->level_item_num[1] = level->level_item_num[0];
+        level->level_item_num[0] = 0;
+        level->migrate_next = 0;
+        level->level_expand_time ++;
+        level->expand_stats.rehash_time = 0;
+        level->expand_stats.commit_time = level_elapsed(&start);
+        level_stash_drain(level);
+        return;                           // resize_state stays 1 until the old bottom level is migrated
+    }
 
-                uint64_t f_idx = F_IDX(F_HASH(level, key), level->addr_capacity);
-                uint64_t s_idx = S_IDX(S_HASH(level, key), level->addr_capacity);
+    uint64_t old_num = pow(2, level->level_size - 1);
+    uint32_t thread_num = level->expand_thread_num;
+    if (thread_num < 1)
+        thread_num = 1;
+    if (thread_num > old_num)
+        thread_num = old_num;
 
-                uint8_t insertSuccess = 0;
-                for(j = 0; j < ASSOC_NUM; j ++){                            
-                    /*  The rehashed item is inserted into the less-loaded bucket between 
-                        the two hash locations in the new level
-                    */
-                    if (newBuckets[f_idx].token[j] == 0)
-                    {
-                        memcpy(newBuckets[f_idx].slot[j].key, key, KEY_LEN);
-                        memcpy(newBuckets[f_idx].slot[j].value, value, VALUE_LEN);
-                        newBuckets[f_idx].token[j] = 1;
-                        insertSuccess = 1;
-                        new_level_item_num ++;
-                        break;
-                    }
-                    if (newBuckets[s_idx].token[j] == 0)
-                    {
-                        memcpy(newBuckets[s_idx].slot[j].key, key, KEY_LEN);
-                        memcpy(newBuckets[s_idx].slot[j].value, value, VALUE_LEN);
-                        newBuckets[s_idx].token[j] = 1;
-                        insertSuccess = 1;
-                        new_level_item_num ++;
-                        break;
-                    }
-                }
-                if(!insertSuccess){
-                    printf("The expanding fails: 3\n");
-                    exit(1);                    
-                }
-                
-                level->buckets[1][old_idx].token[i] = 0;
-            }
+    expand_task task[thread_num];
+    pthread_t thread[thread_num];
+    uint64_t new_level_item_num = 0;
+    uint32_t t;
+    for (t = 0; t < thread_num; t ++) {
+        task[t].level = level;
+        task[t].new_buckets = newBuckets;
+        task[t].begin = old_num * t / thread_num;
+        task[t].end = old_num * (t + 1) / thread_num;
+        task[t].item_num = 0;
+    }
+    // The calling thread rehashes the first range itself
+    for (t = 1; t < thread_num; t ++) {
+        if (pthread_create(&thread[t], NULL, level_expand_rehash, &task[t]) != 0) {
+            printf("The expanding fails: 4\n");
+            exit(1);
         }
     }
+    level_expand_rehash(&task[0]);
+    for (t = 0; t < thread_num; t ++) {
+        if (t > 0)
+            pthread_join(thread[t], NULL);
+        new_level_item_num += task[t].item_num;
+    }
+    level->expand_stats.rehash_time = level_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     level->level_size ++;
     level->total_capacity = pow(2, level->level_size) + pow(2, level->level_size - 1);
 
-    free(level->buckets[1]);
+    level_free(level->buckets[1], pow(2, level->level_size - 2)*sizeof(level_bucket));
     level->buckets[1] = level->buckets[0];
     level->buckets[0] = newBuckets;
     newBuckets = NULL;
@@ -173,6 +766,8 @@ void level_expand(level_hash *level)
     level->level_item_num[0] = new_level_item_num;
     level->level_expand_time ++;
     level->resize_state = 0;
+    level->expand_stats.commit_time = level_elapsed(&start);
+    level_stash_drain(level);
 }
 
 /*
@@ -189,6 +784,8 @@ void level_shrink(level_hash *level)
         exit(1);
     }
 
+    level_migrate(level, level->addr_capacity);
+
     // The shrinking is performed only when the hash table has very few items.
     if(level->level_item_num[0] + level->level_item_num[1] > level->total_capacity*ASSOC_NUM*0.4){
         printf("The shrinking fails: 2\n");
@@ -197,7 +794,12 @@ void level_shrink(level_hash *level)
 
     level->resize_state = 2;
     level->level_size --;
-    level_bucket *newBuckets = alignedmalloc(pow(2, level->level_size - 1)*sizeof(level_bucket));
+    level_prefault_take(level, 0);        // A level pre-faulted for the next expansion is too large
+    level_bucket *newBuckets = level_alloc(&level->alloc_policy, pow(2, level->level_size - 1)*sizeof(level_bucket));
+    if (!newBuckets) {
+        printf("The shrinking fails: 4\n");
+        exit(1);
+    }
     level_bucket *interimBuckets = level->buckets[0];
     level->buckets[0] = level->buckets[1];
     level->buckets[1] = newBuckets;
@@ -212,9 +814,11 @@ void level_shrink(level_hash *level)
     uint64_t old_idx, i;
     for (old_idx = 0; old_idx < pow(2, level->level_size+1); old_idx ++) {
         for(i = 0; i < ASSOC_NUM; i ++){
-            if (interimBuckets[old_idx].token[i] == 1)
+            if (interimBuckets[old_idx].token[i] != 0)
             {
-                if(level_insert(level, interimBuckets[old_idx].slot[i].key, interimBuckets[old_idx].slot[i].value)){
+                uint64_t f_hash, s_hash;
+                SLOT_HASH(level, &interimBuckets[old_idx], i, &f_hash, &s_hash);
+                if(level_insert_item(level, &interimBuckets[old_idx].slot[i], f_hash, s_hash, interimBuckets[old_idx].token[i])){
                         printf("The shrinking fails: 3\n");
                         exit(1);   
                 }
@@ -224,39 +828,68 @@ void level_shrink(level_hash *level)
         }
     } 
 
-    free(interimBuckets);
+    level_free(interimBuckets, pow(2, level->level_size + 1)*sizeof(level_bucket));
     level->level_expand_time = 0;
     level->resize_state = 0;
+    level_stash_drain(level);
 }
 
 /*
-Function: level_dynamic_query() 
-        Lookup a key-value item in level hash table via danamic search scheme;
+Function: level_grow_check()
+        With auto_resize, expand the table before an insertion once the load factor reaches grow_watermark,
+        before insertions start to pay for long movements
+*/
+static inline void level_grow_check(level_hash *level)
+{
+    if (level->auto_resize &&
+        level->level_item_num[0] + level->level_item_num[1] + level->level_item_num[2] >= level->total_capacity*ASSOC_NUM*level->grow_watermark)
+        level_expand(level);
+}
+
+/*
+Function: level_shrink_check()
+        With auto_resize, shrink the table after a deletion once the load factor falls under shrink_watermark;
+        The watermark is capped at a quarter of grow_watermark, so that the load factor after a shrinking, 
+        which doubles it, stays at half the grow watermark and the next insertions do not expand the table again
+*/
+static inline void level_shrink_check(level_hash *level)
+{
+    double watermark = level->shrink_watermark;
+    if (watermark > level->grow_watermark / 4)
+        watermark = level->grow_watermark / 4;
+    if (level->auto_resize && level->level_size > level->min_level_size &&
+        level->level_item_num[0] + level->level_item_num[1] + level->level_item_num[2] < level->total_capacity*ASSOC_NUM*watermark)
+        level_shrink(level);
+}
+
+/*
+Function: level_dynamic_search() 
+        Find the slot of a key in level hash table via danamic search scheme;
         First search the level with more items;
 */
-uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
+static entry* level_dynamic_search(level_hash *level, uint8_t *key, uint32_t key_len)
 {
     
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, key_len, &f_hash, &s_hash);
+    uint8_t fp = KEY_FP(f_hash);
 
-    uint64_t i, j, f_idx, s_idx;
+    uint64_t i, f_idx, s_idx;
+    int j;
     if(level->level_item_num[0] > level->level_item_num[1]){
         f_idx = F_IDX(f_hash, level->addr_capacity);
         s_idx = S_IDX(s_hash, level->addr_capacity); 
 
         for(i = 0; i < 2; i ++){
-            for(j = 0; j < ASSOC_NUM; j ++){
-                if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-                {
-                    return level->buckets[i][f_idx].slot[j].value;
-                }
+            j = bucket_find(&level->buckets[i][f_idx], fp, key, key_len);
+            if (j != -1)
+            {
+                return &level->buckets[i][f_idx].slot[j];
             }
-            for(j = 0; j < ASSOC_NUM; j ++){
-                if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-                {
-                    return level->buckets[i][s_idx].slot[j].value;
-                }
+            j = bucket_find(&level->buckets[i][s_idx], fp, key, key_len);
+            if (j != -1)
+            {
+                return &level->buckets[i][s_idx].slot[j];
             }
             f_idx = F_IDX(f_hash, level->addr_capacity / 2);
             s_idx = S_IDX(s_hash, level->addr_capacity / 2);
@@ -267,23 +900,63 @@ uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
         s_idx = S_IDX(s_hash, level->addr_capacity/2);
 
         for(i = 2; i > 0; i --){
-            for(j = 0; j < ASSOC_NUM; j ++){
-                if (level->buckets[i-1][f_idx].token[j] == 1&&strcmp(level->buckets[i-1][f_idx].slot[j].key, key) == 0)
-                {
-                    return level->buckets[i-1][f_idx].slot[j].value;
-                }
+            j = bucket_find(&level->buckets[i-1][f_idx], fp, key, key_len);
+            if (j != -1)
+            {
+                return &level->buckets[i-1][f_idx].slot[j];
             }
-            for(j = 0; j < ASSOC_NUM; j ++){
-                if (level->buckets[i-1][s_idx].token[j] == 1&&strcmp(level->buckets[i-1][s_idx].slot[j].key, key) == 0)
-                {
-                    return level->buckets[i-1][s_idx].slot[j].value;
-                }
+            j = bucket_find(&level->buckets[i-1][s_idx], fp, key, key_len);
+            if (j != -1)
+            {
+                return &level->buckets[i-1][s_idx].slot[j];
             }
             f_idx = F_IDX(f_hash, level->addr_capacity);
             s_idx = S_IDX(s_hash, level->addr_capacity);
         }
     }
-    return NULL;
+    entry *item = level_search_migrating(level, key, key_len, fp, f_hash, s_hash);
+    return item ? item : level_stash_search(level, key, key_len, fp, s_hash);
+}
+
+/*
+Function: level_dynamic_query() 
+        Lookup a key-value item in level hash table via danamic search scheme;
+        First search the level with more items;
+*/
+uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
+{
+    uint32_t value_len;
+    entry *item = level_dynamic_search(level, key, KEY_SIZE(key));
+    return item ? entry_value(item, &value_len) : NULL;
+}
+
+/*
+Function: level_static_search_hashed() 
+        Find the slot of a key with known hash values via static search scheme;
+*/
+static entry* level_static_search_hashed(level_hash *level, uint8_t *key, uint32_t key_len, uint64_t f_hash, uint64_t s_hash)
+{
+    uint8_t fp = KEY_FP(f_hash);
+    entry *item = level_search_pair(level, 0, key, key_len, fp, f_hash, s_hash);
+    if (item == NULL)
+        item = level_search_pair(level, 1, key, key_len, fp, f_hash, s_hash);
+    if (item == NULL)
+        item = level_search_migrating(level, key, key_len, fp, f_hash, s_hash);
+    if (item == NULL)
+        item = level_stash_search(level, key, key_len, fp, s_hash);
+    return item;
+}
+
+/*
+Function: level_static_search() 
+        Find the slot of a key in level hash table via static search scheme;
+        Always first search the top level and then search the bottom level;
+*/
+static entry* level_static_search(level_hash *level, uint8_t *key, uint32_t key_len)
+{
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, key_len, &f_hash, &s_hash);
+    return level_static_search_hashed(level, key, key_len, f_hash, s_hash);
 }
 
 /*
@@ -293,103 +966,217 @@ Function: level_static_query()
 */
 uint8_t* level_static_query(level_hash *level, uint8_t *key)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                return level->buckets[i][f_idx].slot[j].value;
+    uint32_t value_len;
+    entry *item = level_static_search(level, key, KEY_SIZE(key));
+    return item ? entry_value(item, &value_len) : NULL;
+}
+
+/*
+Function: level_multi_query() 
+        Lookup a batch of keys via static search scheme and set values[i] to the value of keys[i], or NULL;
+        The four candidate buckets of MULTI_QUERY_BATCH keys are prefetched before any of them is searched,
+        so that their cache misses overlap
+*/
+void level_multi_query(level_hash *level, uint8_t *keys[], uint64_t n, uint8_t *values[])
+{
+    uint64_t f_hash[MULTI_QUERY_BATCH], s_hash[MULTI_QUERY_BATCH];
+    uint32_t key_len[MULTI_QUERY_BATCH];
+    uint32_t value_len;
+    uint64_t b, i, k, batch;
+
+    for (b = 0; b < n; b += MULTI_QUERY_BATCH) {
+        batch = n - b < MULTI_QUERY_BATCH ? n - b : MULTI_QUERY_BATCH;
+        for (k = 0; k < batch; k ++) {
+            key_len[k] = KEY_SIZE(keys[b + k]);
+            FS_HASH(level, keys[b + k], key_len[k], &f_hash[k], &s_hash[k]);
+            for (i = 0; i < 2; i ++) {
+                PREFETCH_BUCKET(&level->buckets[i][F_IDX(f_hash[k], level->addr_capacity >> i)], 0);
+                PREFETCH_BUCKET(&level->buckets[i][S_IDX(s_hash[k], level->addr_capacity >> i)], 0);
             }
         }
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {
-                return level->buckets[i][s_idx].slot[j].value;
-            }
+        for (k = 0; k < batch; k ++) {
+            entry *item = level_static_search_hashed(level, keys[b + k], key_len[k], f_hash[k], s_hash[k]);
+            values[b + k] = item ? entry_value(item, &value_len) : NULL;
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
     }
-
-    return NULL;
 }
 
+typedef struct interleave_context {       // The state of one of the requests interleaved by level_interleaved_query() and level_interleaved_insert()
+    uint64_t k;                           // The index of the request in the batch
+    uint8_t stage;                        // 0: idle; 1: the top-level buckets are prefetched; 2: the bottom-level buckets are prefetched
+    uint8_t fp;
+    uint32_t key_len;
+    uint64_t f_hash;
+    uint64_t s_hash;
+    entry item;                           // The item being inserted
+} interleave_context;
 
 /*
-Function: level_delete() 
+Function: level_interleaved_query() 
+        Lookup a batch of keys via static search scheme and set values[i] to the value of keys[i], or NULL;
+        INTERLEAVE_NUM lookups run as state machines that prefetch the buckets of the level they search next
+        and then yield to the next lookup, which searches buckets prefetched one round earlier
+*/
+void level_interleaved_query(level_hash *level, uint8_t *keys[], uint64_t n, uint8_t *values[])
+{
+    interleave_context ctx[INTERLEAVE_NUM];
+    uint64_t next = 0, done = 0;
+    uint32_t value_len;
+    int c;
+
+    for (c = 0; c < INTERLEAVE_NUM; c ++)
+        ctx[c].stage = 0;
+
+    while (done < n) {
+        for (c = 0; c < INTERLEAVE_NUM; c ++) {
+            interleave_context *x = &ctx[c];
+            if (x->stage == 0) {
+                if (next == n)
+                    continue;
+                x->k = next ++;
+                x->key_len = KEY_SIZE(keys[x->k]);
+                FS_HASH(level, keys[x->k], x->key_len, &x->f_hash, &x->s_hash);
+                x->fp = KEY_FP(x->f_hash);
+                PREFETCH_BUCKET(&level->buckets[0][F_IDX(x->f_hash, level->addr_capacity)], 0);
+                PREFETCH_BUCKET(&level->buckets[0][S_IDX(x->s_hash, level->addr_capacity)], 0);
+                x->stage = 1;
+                continue;
+            }
+
+            uint64_t i = x->stage - 1;
+            entry *item = level_search_pair(level, i, keys[x->k], x->key_len, x->fp, x->f_hash, x->s_hash);
+            if (item == NULL && i == 0) {
+                PREFETCH_BUCKET(&level->buckets[1][F_IDX(x->f_hash, level->addr_capacity / 2)], 0);
+                PREFETCH_BUCKET(&level->buckets[1][S_IDX(x->s_hash, level->addr_capacity / 2)], 0);
+                x->stage = 2;
+                continue;
+            }
+            if (item == NULL)
+                item = level_search_migrating(level, keys[x->k], x->key_len, x->fp, x->f_hash, x->s_hash);
+            if (item == NULL)
+                item = level_stash_search(level, keys[x->k], x->key_len, x->fp, x->s_hash);
+            values[x->k] = item ? entry_value(item, &value_len) : NULL;
+            x->stage = 0;
+            done ++;
+        }
+    }
+}
+
+/*
+Function: level_delete_key() 
         Remove a key-value item from level hash table;
         The function can be optimized by using the dynamic search scheme
 */
-uint8_t level_delete(level_hash *level, uint8_t *key)
+static uint8_t level_delete_key(level_hash *level, uint8_t *key, uint32_t key_len)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    level_migrate(level, level->migrate_bucket_num);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, key_len, &f_hash, &s_hash);
+    uint8_t fp = KEY_FP(f_hash);
     uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
     uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
     
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                level->buckets[i][f_idx].token[j] = 0;
-                level->level_item_num[i] --;
-                return 0;
-            }
+    uint64_t i;
+    int j;
+    // The old bottom level is searched last during an incremental expansion
+    for(i = 0; i < 3 && level->buckets[i] != NULL; i ++){
+        j = bucket_find(&level->buckets[i][f_idx], fp, key, key_len);
+        if (j != -1)
+        {
+            level->buckets[i][f_idx].token[j] = 0;
+            entry_free(level, &level->buckets[i][f_idx].slot[j]);
+            level->level_item_num[i] --;
+            level_shrink_check(level);
+            return 0;
         }
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {
-                level->buckets[i][s_idx].token[j] = 0;
-                level->level_item_num[i] --;
-                return 0;
-            }
+        j = bucket_find(&level->buckets[i][s_idx], fp, key, key_len);
+        if (j != -1)
+        {
+            level->buckets[i][s_idx].token[j] = 0;
+            entry_free(level, &level->buckets[i][s_idx].slot[j]);
+            level->level_item_num[i] --;
+            level_shrink_check(level);
+            return 0;
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+        f_idx = F_IDX(f_hash, level->addr_capacity >> (i + 1));
+        s_idx = S_IDX(s_hash, level->addr_capacity >> (i + 1));
     }
 
+    j = level_stash_find(level, key, key_len, fp, s_hash);
+    if (j != -1)
+    {
+        entry_free(level, &level->stash[j].item);
+        level_stash_remove(level, j);
+        level_shrink_check(level);
+        return 0;
+    }
     return 1;
 }
 
 /*
-Function: level_update() 
+Function: level_delete() 
+        Remove a key-value item from level hash table;
+*/
+uint8_t level_delete(level_hash *level, uint8_t *key)
+{
+    return level_delete_key(level, key, KEY_SIZE(key));
+}
+
+/*
+Function: level_update_key() 
         Update the value of a key-value item in level hash table;
         The function can be optimized by using the dynamic search scheme
 */
+static uint8_t level_update_key(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *new_value, uint32_t value_len)
+{
+    entry *item = level_static_search(level, key, key_len);
+    if (item == NULL)
+        return 1;
+
+#ifdef VAR_ITEM
+    // The key stays the same, so only the slot contents change and the token and hash tags remain valid
+    entry new_item;
+    entry_set(level, &new_item, key, key_len, new_value, value_len);
+    entry_free(level, item);
+    *item = new_item;
+#else
+    memcpy(item->value, new_value, VALUE_LEN);
+#endif
+    return 0;
+}
+
+/*
+Function: level_update() 
+        Update the value of a key-value item in level hash table;
+*/
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-    uint64_t i, j;
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][f_idx].token[j] == 1&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
-            {
-                memcpy(level->buckets[i][f_idx].slot[j].value, new_value, VALUE_LEN);
-                return 0;
-            }
-        }
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[i][s_idx].token[j] == 1&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
-            {
-                memcpy(level->buckets[i][s_idx].slot[j].value, new_value, VALUE_LEN);
-                return 0;
-            }
+    return level_update_key(level, key, KEY_SIZE(key), new_value, VALUE_LEN);
+}
+
+/*
+Function: level_insert_key() 
+        Insert a key-value item into level hash table;
+*/
+static uint8_t level_insert_key(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *value, uint32_t value_len)
+{
+    level_migrate(level, level->migrate_bucket_num);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, key_len, &f_hash, &s_hash);
+    level_grow_check(level);
+
+    entry item;
+    entry_set(level, &item, key, key_len, value, value_len);
+    // With auto_resize, an insertion that fails expands the table and is retried
+    while (level_insert_item(level, &item, f_hash, s_hash, KEY_FP(f_hash))) {
+        if (!level->auto_resize) {
+            entry_free(level, &item);
+            return 1;
         }
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+        level_expand(level);
     }
-
-    return 1;
+    level_prefault_check(level);
+    return 0;
 }
 
 /*
@@ -398,49 +1185,238 @@ Function: level_insert()
 */
 uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
-    uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
-    uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
+    return level_insert_key(level, key, KEY_SIZE(key), value, VALUE_LEN);
+}
 
-    uint64_t i, j;
-    int empty_location;
+/*
+Function: level_interleaved_insert() 
+        Insert a batch of key-value items and set results[i] to what level_insert() returns for keys[i];
+        INTERLEAVE_NUM insertions run as state machines like the lookups of level_interleaved_query(),
+        and an insertion that finds its four candidate buckets full falls back to movements
+*/
+void level_interleaved_insert(level_hash *level, uint8_t *keys[], uint8_t *values[], uint64_t n, uint8_t results[])
+{
+    interleave_context ctx[INTERLEAVE_NUM];
+    uint64_t next = 0, done = 0;
+    int c;
 
-    for(i = 0; i < 2; i ++){
-        for(j = 0; j < ASSOC_NUM; j ++){        
-            /*  The new item is inserted into the less-loaded bucket between 
-                the two hash locations in each level           
-            */      
-            if (level->buckets[i][f_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[i][f_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[i][f_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[i][f_idx].token[j] = 1;
-                level->level_item_num[i] ++;
-                return 0;
+    for (c = 0; c < INTERLEAVE_NUM; c ++)
+        ctx[c].stage = 0;
+
+    while (done < n) {
+        for (c = 0; c < INTERLEAVE_NUM; c ++) {
+            interleave_context *x = &ctx[c];
+            if (x->stage == 0) {
+                if (next == n)
+                    continue;
+                x->k = next ++;
+                x->key_len = KEY_SIZE(keys[x->k]);
+                FS_HASH(level, keys[x->k], x->key_len, &x->f_hash, &x->s_hash);
+                x->fp = KEY_FP(x->f_hash);
+                level_migrate(level, level->migrate_bucket_num);
+                level_grow_check(level);
+                entry_set(level, &x->item, keys[x->k], x->key_len, values[x->k], VALUE_LEN);
+                PREFETCH_BUCKET(&level->buckets[0][F_IDX(x->f_hash, level->addr_capacity)], 1);
+                PREFETCH_BUCKET(&level->buckets[0][S_IDX(x->s_hash, level->addr_capacity)], 1);
+                x->stage = 1;
+                continue;
             }
-            if (level->buckets[i][s_idx].token[j] == 0) 
-            {
-                memcpy(level->buckets[i][s_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[i][s_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[i][s_idx].token[j] = 1;
-                level->level_item_num[i] ++;
-                return 0;
+
+            uint64_t i = x->stage - 1;
+            if (level_store_pair(level, i, &x->item, x->f_hash, x->s_hash, x->fp) == 0) {
+                results[x->k] = 0;
+                level_prefault_check(level);
             }
+            else if (i == 0) {
+                PREFETCH_BUCKET(&level->buckets[1][F_IDX(x->f_hash, level->addr_capacity / 2)], 1);
+                PREFETCH_BUCKET(&level->buckets[1][S_IDX(x->s_hash, level->addr_capacity / 2)], 1);
+                x->stage = 2;
+                continue;
+            }
+            else {
+                results[x->k] = level_insert_item(level, &x->item, x->f_hash, x->s_hash, x->fp);
+                while (results[x->k] && level->auto_resize) {
+                    level_expand(level);
+                    results[x->k] = level_insert_item(level, &x->item, x->f_hash, x->s_hash, x->fp);
+                }
+                if (results[x->k])
+                    entry_free(level, &x->item);
+                else
+                    level_prefault_check(level);
+            }
+            x->stage = 0;
+            done ++;
         }
-        
-        f_idx = F_IDX(f_hash, level->addr_capacity / 2);
-        s_idx = S_IDX(s_hash, level->addr_capacity / 2);
+    }
+}
+
+#ifdef VAR_ITEM
+/*
+Function: level_insert_var() 
+        Insert a key-value item of any length into level hash table;
+*/
+uint8_t level_insert_var(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *value, uint32_t value_len)
+{
+    return level_insert_key(level, key, key_len, value, value_len);
+}
+
+/*
+Function: level_query_var() 
+        Lookup a key of any length in level hash table via dynamic search scheme;
+        Return the value and set its length, or return NULL if the key is absent
+*/
+uint8_t* level_query_var(level_hash *level, uint8_t *key, uint32_t key_len, uint32_t *value_len)
+{
+    entry *item = level_dynamic_search(level, key, key_len);
+    return item ? entry_value(item, value_len) : NULL;
+}
+
+/*
+Function: level_delete_var() 
+        Remove a key-value item of any length from level hash table;
+*/
+uint8_t level_delete_var(level_hash *level, uint8_t *key, uint32_t key_len)
+{
+    return level_delete_key(level, key, key_len);
+}
+
+/*
+Function: level_update_var() 
+        Replace the value of a key-value item of any length in level hash table;
+*/
+uint8_t level_update_var(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *new_value, uint32_t value_len)
+{
+    return level_update_key(level, key, key_len, new_value, value_len);
+}
+#endif
+
+typedef struct displace_node {            // A bucket visited by level_displace()
+    uint64_t idx;                         // The bucket in its level
+    uint8_t level;
+    uint8_t slot;                         // The slot of the parent bucket whose item would move into this bucket
+    uint8_t depth;                        // The number of items moved to free a slot in this bucket
+    int16_t parent;                       // The parent in the queue, or -1 for a candidate bucket of the new item
+} displace_node;
+
+/*
+Function: level_move_slot() 
+        Move the item in the k-th slot of a bucket into the empty j-th slot of another bucket, in the same or the other level
+*/
+static inline void level_move_slot(level_hash *level, uint64_t from_level, level_bucket *from, uint64_t k, uint64_t to_level, level_bucket *to, uint64_t j)
+{
+    uint64_t f_hash, s_hash;
+    SLOT_HASH(level, from, k, &f_hash, &s_hash);
+    slot_store(to, j, &from->slot[k], f_hash, s_hash);
+    to->token[j] = from->token[k];
+    from->token[k] = 0;
+    level->level_item_num[to_level] ++;
+    level->level_item_num[from_level] --;
+}
+
+/*
+Function: displace_on_path() 
+        Return 1 if a bucket is one of the buckets on the path from a node to its candidate bucket
+*/
+static inline int displace_on_path(displace_node *queue, int n, uint64_t level_num, uint64_t idx)
+{
+    for (; n != -1; n = queue[n].parent) {
+        if (queue[n].level == level_num && queue[n].idx == idx)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+Function: level_displace() 
+        Search breadth-first from the four candidate buckets of an item for a chain of at most displace_depth items,
+        each movable to another of its buckets in either level, that ends at an empty slot; then move the chain 
+        from its end and store the item in the slot freed in its candidate bucket;
+        Return 1 if no such chain is found within DISPLACE_NODE_NUM buckets
+*/
+static uint8_t level_displace(level_hash *level, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp)
+{
+    displace_node queue[DISPLACE_NODE_NUM];
+    int head, tail = 0;
+    uint64_t i, j, k, a;
+
+    if (level->displace_depth == 0)
+        return 1;
+    for (i = 0; i < 2; i ++) {
+        queue[tail ++] = (displace_node){F_IDX(f_hash, level->addr_capacity >> i), i, 0, 0, -1};
+        queue[tail ++] = (displace_node){S_IDX(s_hash, level->addr_capacity >> i), i, 0, 0, -1};
+    }
+
+    for (head = 0; head < tail; head ++) {
+        displace_node *node = &queue[head];
+        level_bucket *bucket = &level->buckets[node->level][node->idx];
+        for (k = 0; k < ASSOC_NUM; k ++) {
+            // The other buckets of the item in the k-th slot: one in the same level and two in the other level
+            uint64_t m_f_hash, m_s_hash;
+            SLOT_HASH(level, bucket, k, &m_f_hash, &m_s_hash);
+            uint64_t other = 1 - node->level;
+            uint64_t alt_level[3] = {node->level, other, other};
+            uint64_t alt_idx[3] = {F_IDX(m_f_hash, level->addr_capacity >> node->level),
+                F_IDX(m_f_hash, level->addr_capacity >> other), S_IDX(m_s_hash, level->addr_capacity >> other)};
+            if (alt_idx[0] == node->idx)
+                alt_idx[0] = S_IDX(m_s_hash, level->addr_capacity >> node->level);
+
+            for (a = 0; a < 3; a ++) {
+                if (displace_on_path(queue, head, alt_level[a], alt_idx[a]))
+                    continue;
+                level_bucket *alt = &level->buckets[alt_level[a]][alt_idx[a]];
+                for (j = 0; j < ASSOC_NUM; j ++) {
+                    if (alt->token[j] == 0)
+                        break;
+                }
+                if (j < ASSOC_NUM) {
+                    // Each item of the chain moves into the slot freed by the item after it
+                    level_move_slot(level, node->level, bucket, k, alt_level[a], alt, j);
+                    uint64_t free_slot = k;
+                    int n;
+                    for (n = head; queue[n].parent != -1; n = queue[n].parent) {
+                        displace_node *parent = &queue[queue[n].parent];
+                        level_move_slot(level, parent->level, &level->buckets[parent->level][parent->idx], queue[n].slot,
+                            queue[n].level, &level->buckets[queue[n].level][queue[n].idx], free_slot);
+                        free_slot = queue[n].slot;
+                    }
+                    bucket = &level->buckets[queue[n].level][queue[n].idx];
+                    slot_store(bucket, free_slot, item, f_hash, s_hash);
+                    bucket->token[free_slot] = fp;
+                    level->level_item_num[queue[n].level] ++;
+                    return 0;
+                }
+                if (node->depth + 1 < level->displace_depth && tail < DISPLACE_NODE_NUM)
+                    queue[tail ++] = (displace_node){alt_idx[a], alt_level[a], k, node->depth + 1, head};
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+Function: level_insert_item() 
+        Insert an item with known hash values and fingerprint into level hash table;
+        The movements of one item are tried first, then the displacement search, and then the stash
+*/
+static uint8_t level_insert_item(level_hash *level, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp)
+{
+    uint64_t f_idx, s_idx;
+    uint64_t i;
+    int empty_location;
+
+    for(i = 0; i < 2; i ++){
+        if (!level_store_pair(level, i, item, f_hash, s_hash, fp))
+            return 0;
     }
 
     f_idx = F_IDX(f_hash, level->addr_capacity);
     s_idx = S_IDX(s_hash, level->addr_capacity);
     
     for(i = 0; i < 2; i++){
-        if(!try_movement(level, f_idx, i, key, value)){
+        if(!try_movement(level, f_idx, i, item, f_hash, s_hash, fp)){
             return 0;
         }
-        if(!try_movement(level, s_idx, i, key, value)){
+        if(!try_movement(level, s_idx, i, item, f_hash, s_hash, fp)){
             return 0;
         }
 
@@ -451,41 +1427,42 @@ uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
     if(level->level_expand_time > 0){
         empty_location = b2t_movement(level, f_idx);
         if(empty_location != -1){
-            memcpy(level->buckets[1][f_idx].slot[empty_location].key, key, KEY_LEN);
-            memcpy(level->buckets[1][f_idx].slot[empty_location].value, value, VALUE_LEN);
-            level->buckets[1][f_idx].token[empty_location] = 1;
+            slot_store(&level->buckets[1][f_idx], empty_location, item, f_hash, s_hash);
+            level->buckets[1][f_idx].token[empty_location] = fp;
             level->level_item_num[1] ++;
             return 0;
         }
 
         empty_location = b2t_movement(level, s_idx);
         if(empty_location != -1){
-            memcpy(level->buckets[1][s_idx].slot[empty_location].key, key, KEY_LEN);
-            memcpy(level->buckets[1][s_idx].slot[empty_location].value, value, VALUE_LEN);
-            level->buckets[1][s_idx].token[empty_location] = 1;
+            slot_store(&level->buckets[1][s_idx], empty_location, item, f_hash, s_hash);
+            level->buckets[1][s_idx].token[empty_location] = fp;
             level->level_item_num[1] ++;
             return 0;
         }
     }
 
-    return 1;
+    if (!level_displace(level, item, f_hash, s_hash, fp))
+        return 0;
+
+    // A few items that still find no slot wait in the stash, so that one unlucky key does not expand the table
+    return level_stash_put(level, item, f_hash, s_hash, fp);
 }
 
 /*
 Function: try_movement() 
         Try to move an item from the current bucket to its same-level alternative bucket;
 */
-uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value)
+uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp)
 {
     uint64_t i, j, jdx;
 
     for(i = 0; i < ASSOC_NUM; i ++){
-        uint8_t *m_key = level->buckets[level_num][idx].slot[i].key;
-        uint8_t *m_value = level->buckets[level_num][idx].slot[i].value;
-        uint64_t f_hash = F_HASH(level, m_key);
-        uint64_t s_hash = S_HASH(level, m_key);
-        uint64_t f_idx = F_IDX(f_hash, level->addr_capacity/(1+level_num));
-        uint64_t s_idx = S_IDX(s_hash, level->addr_capacity/(1+level_num));
+        entry *m_item = &level->buckets[level_num][idx].slot[i];
+        uint64_t m_f_hash, m_s_hash;
+        SLOT_HASH(level, &level->buckets[level_num][idx], i, &m_f_hash, &m_s_hash);
+        uint64_t f_idx = F_IDX(m_f_hash, level->addr_capacity/(1+level_num));
+        uint64_t s_idx = S_IDX(m_s_hash, level->addr_capacity/(1+level_num));
         
         if(f_idx == idx)
             jdx = s_idx;
@@ -495,15 +1472,13 @@ uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_
         for(j = 0; j < ASSOC_NUM; j ++){
             if (level->buckets[level_num][jdx].token[j] == 0)
             {
-                memcpy(level->buckets[level_num][jdx].slot[j].key, m_key, KEY_LEN);
-                memcpy(level->buckets[level_num][jdx].slot[j].value, m_value, VALUE_LEN);
-                level->buckets[level_num][jdx].token[j] = 1;
+                slot_store(&level->buckets[level_num][jdx], j, m_item, m_f_hash, m_s_hash);
+                level->buckets[level_num][jdx].token[j] = level->buckets[level_num][idx].token[i];
                 level->buckets[level_num][idx].token[i] = 0;
                 // The movement is finished and then the new item is inserted
 
-                memcpy(level->buckets[level_num][idx].slot[i].key, key, KEY_LEN);
-                memcpy(level->buckets[level_num][idx].slot[i].value, value, VALUE_LEN);
-                level->buckets[level_num][idx].token[i] = 1;
+                slot_store(&level->buckets[level_num][idx], i, item, f_hash, s_hash);
+                level->buckets[level_num][idx].token[i] = fp;
                 level->level_item_num[level_num] ++;
                 
                 return 0;
@@ -520,40 +1495,29 @@ Function: b2t_movement()
 */
 int b2t_movement(level_hash *level, uint64_t idx)
 {
-    uint8_t *key, *value;
+    entry *item;
     uint64_t s_hash, f_hash;
     uint64_t s_idx, f_idx;
     
     uint64_t i, j;
     for(i = 0; i < ASSOC_NUM; i ++){
-        key = level->buckets[1][idx].slot[i].key;
-        value = level->buckets[1][idx].slot[i].value;
-        f_hash = F_HASH(level, key);
-        s_hash = S_HASH(level, key);  
+        item = &level->buckets[1][idx].slot[i];
+        SLOT_HASH(level, &level->buckets[1][idx], i, &f_hash, &s_hash);
         f_idx = F_IDX(f_hash, level->addr_capacity);
         s_idx = S_IDX(s_hash, level->addr_capacity);
-    
-        for(j = 0; j < ASSOC_NUM; j ++){
-            if (level->buckets[0][f_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[0][f_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[0][f_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[0][f_idx].token[j] = 1;
-                level->buckets[1][idx].token[i] = 0;
-                level->level_item_num[0] ++;
-                level->level_item_num[1] --;
-                return i;
-            }
-            else if (level->buckets[0][s_idx].token[j] == 0)
-            {
-                memcpy(level->buckets[0][s_idx].slot[j].key, key, KEY_LEN);
-                memcpy(level->buckets[0][s_idx].slot[j].value, value, VALUE_LEN);
-                level->buckets[0][s_idx].token[j] = 1;
-                level->buckets[1][idx].token[i] = 0;
-                level->level_item_num[0] ++;
-                level->level_item_num[1] --;
-                return i;
-            }
+
+        // The item moves to the top-level bucket bucket_choose() picks
+        level_bucket *bucket = bucket_choose(level, &level->buckets[0][f_idx], &level->buckets[0][s_idx]);
+        uint32_t empty = bucket_match(bucket, 0);
+        if (empty)
+        {
+            j = __builtin_ctz(empty);
+            slot_store(bucket, j, item, f_hash, s_hash);
+            bucket->token[j] = level->buckets[1][idx].token[i];
+            level->buckets[1][idx].token[i] = 0;
+            level->level_item_num[0] ++;
+            level->level_item_num[1] --;
+            return i;
         }
     }
 
@@ -566,7 +1530,23 @@ Function: level_destroy()
 */
 void level_destroy(level_hash *level)
 {
-    free(level->buckets[0]);
-    free(level->buckets[1]);
+    level_prefault_take(level, 0);
+#ifdef VAR_ITEM
+    uint64_t i, j, k;
+    for(i = 0; i < 3 && level->buckets[i] != NULL; i ++){
+        for(j = 0; j < level->addr_capacity >> i; j ++){
+            for(k = 0; k < ASSOC_NUM; k ++){
+                if (level->buckets[i][j].token[k] != 0)
+                    entry_free(level, &level->buckets[i][j].slot[k]);
+            }
+        }
+    }
+    for(i = 0; i < level->stash_num; i ++)
+        entry_free(level, &level->stash[i].item);
+    level_arena_destroy(&level->arena);
+#endif
+    level_free(level->buckets[0], level->addr_capacity*sizeof(level_bucket));
+    level_free(level->buckets[1], level->addr_capacity/2*sizeof(level_bucket));
+    level_free(level->buckets[2], level->addr_capacity/4*sizeof(level_bucket));
     level = NULL;
 }
\ No newline at end of file
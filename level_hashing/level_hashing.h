@@ -5,26 +5,131 @@
 #include <time.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include "hash.h"
+#include "level_alloc.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define ASSOC_NUM 4                       // The number of slots in a bucket
+#define ASSOC_NUM 4                       // The number of slots in a bucket; the tokens of a bucket are compared at once if it is no more than 16
+
+// Keys are NUL-terminated strings of at most KEY_LEN bytes by default;
+// define BINARY_KEY for binary keys of exactly KEY_LEN bytes, or INTEGER_KEY for 8-byte integer keys
+#ifdef INTEGER_KEY
+#define KEY_LEN 8                         // An integer key is a uint64_t in native byte order
+#else
 #define KEY_LEN 16                        // The maximum length of a key
+#endif
+
 #define VALUE_LEN 15                      // The maximum length of a value
 
+// Define VAR_ITEM to store keys and values of any length with level_insert_var() and the like;
+// an item stays in its slot if its key and value fit in INLINE_LEN bytes, and is otherwise stored 
+// in a record allocated out of line, which the slot points to
+#ifdef VAR_ITEM
+#ifdef INTEGER_KEY
+#error "VAR_ITEM stores keys of any length and cannot be combined with INTEGER_KEY"
+#endif
+#define INLINE_LEN (KEY_LEN + VALUE_LEN - 2)
+#define OUTLINE_ITEM 0xFF                 // The key_len of a slot whose item is stored out of line
+#endif
+
+// Define HASH_TAG (e.g., make CFLAGS=-DHASH_TAG) to keep the hash values of every item in its bucket,
+// so that movements and resizing never rehash keys, at the cost of 8 more bytes per slot
+
+#ifndef MULTI_QUERY_BATCH
+#define MULTI_QUERY_BATCH 16              // The number of keys whose buckets level_multi_query() prefetches at once
+#endif
+
+#ifndef INTERLEAVE_NUM
+#define INTERLEAVE_NUM 8                  // The number of requests level_interleaved_query() and level_interleaved_insert() run at once
+#endif
+
+#ifndef PREFAULT_WATERMARK
+#define PREFAULT_WATERMARK 0.7            // The default load factor at which the next top level is prepared in the background; 0 disables it
+#endif
+
+#ifndef GROW_WATERMARK
+#define GROW_WATERMARK 0.85               // The default load factor at which an insertion first expands the table if auto_resize is set
+#endif
+
+#ifndef SHRINK_WATERMARK
+#define SHRINK_WATERMARK 0.1              // The default load factor under which a deletion shrinks the table if auto_resize is set
+#endif
+
+#ifndef INCREMENTAL_EXPAND
+#define INCREMENTAL_EXPAND 0              // "1": expansions are incremental by default, see incremental_expand
+#endif
+
+#ifndef MIGRATE_BUCKET_NUM
+#define MIGRATE_BUCKET_NUM 4              // The default number of old-bottom buckets an insertion or deletion migrates during an incremental expansion
+#endif
+
+#ifndef DISPLACE_DEPTH
+#define DISPLACE_DEPTH 4                  // The default maximum number of items moved by one displacement search; 0 disables the search
+#endif
+
+#ifndef LEAST_LOADED
+#define LEAST_LOADED 1                    // By default, an item goes to the candidate bucket with more empty slots; 0 takes the first empty slot instead
+#endif
+
+#ifndef DISPLACE_NODE_NUM
+#define DISPLACE_NODE_NUM 256             // The maximum number of buckets one displacement search visits
+#endif
+
+#ifndef STASH_SIZE
+#define STASH_SIZE 8                      // The number of items the stash of a table holds, at least 1
+#endif
+
+#ifndef EXPAND_THREAD_NUM
+#define EXPAND_THREAD_NUM 1               // The default number of threads rehashing the bottom level during an expansion
+#endif
+
 typedef struct entry{                     // A slot storing a key-value item 
+#ifdef VAR_ITEM
+    uint8_t key_len;                      // The length of the inline key, or OUTLINE_ITEM
+    uint8_t value_len;                    // The length of the inline value
+    union {
+        uint8_t data[INLINE_LEN];         // The inline key followed by the inline value
+        struct __attribute__((packed)) {
+            uint32_t key_len;
+            uint32_t value_len;
+            uint8_t *data;                // The out-of-line record: the key followed by the value
+        } outline;
+    };
+#else
     uint8_t key[KEY_LEN];
     uint8_t value[VALUE_LEN];
+#endif
 } entry;
 
 typedef struct level_bucket               // A bucket
 {
-    uint8_t token[ASSOC_NUM];             // A token indicates whether its corresponding slot is empty, which can also be implemented using 1 bit
+    uint8_t token[ASSOC_NUM];             // A token is 0 if its corresponding slot is empty, and otherwise the non-zero fingerprint of the key in the slot
+#ifdef HASH_TAG
+    uint32_t f_tag[ASSOC_NUM];            // The low 32 bits of the first and second hash values of the item in each slot,
+    uint32_t s_tag[ASSOC_NUM];            // enough to locate it in a level of up to 2^33 buckets
+#endif
     entry slot[ASSOC_NUM];
 } level_bucket;
 
+typedef struct level_stash_item {        // An item that found no slot in its buckets, kept with its hash values for the next expansion
+    entry item;
+    uint64_t f_hash;
+    uint64_t s_hash;
+    uint8_t fp;
+} level_stash_item;
+
+typedef struct level_expand_stats {      // The time spent in each phase of the last expansion, in seconds
+    double alloc_time;                    // Allocating and zeroing the new level
+    double rehash_time;                   // Rehashing the bottom-level items into the new level
+    double commit_time;                   // Freeing the old bottom level and installing the new level
+} level_expand_stats;
+
 typedef struct level_hash {               // A Level hash table
-    level_bucket *buckets[2];             // The top level and bottom level in the Level hash table
-    uint64_t level_item_num[2];           // The numbers of items stored in the top and bottom levels respectively
+    level_bucket *buckets[3];             // The top level, the bottom level, and the old bottom level still migrated by an incremental expansion (NULL otherwise)
+    uint64_t level_item_num[3];           // The numbers of items stored in the top, bottom and old bottom levels respectively
     uint64_t addr_capacity;               // The number of buckets in the top level
     uint64_t total_capacity;              // The number of all buckets in the Level hash table    
     uint64_t level_size;                  // level_size = log2(addr_capacity)
@@ -33,25 +138,69 @@ typedef struct level_hash {               // A Level hash table
                                           // ‘1’ means the hash table is being expanded; ‘2’ means the hash table is being shrunk.
     uint64_t f_seed;
     uint64_t s_seed;                      // Two randomized seeds for hash functions
+    uint32_t expand_thread_num;           // The number of threads rehashing the bottom level during an expansion
+    level_expand_stats expand_stats;      // The phase timing of the last expansion
+    uint8_t incremental_expand;           // "1": level_expand() only installs the new top level, and the next insertions and deletions
+                                          // migrate the old bottom level migrate_bucket_num buckets at a time; "0": it rehashes the bottom level at once
+    uint32_t migrate_bucket_num;          // The number of old-bottom buckets an insertion or deletion migrates
+    uint64_t migrate_next;                // The next old-bottom bucket to be migrated
+    uint32_t displace_depth;              // The maximum number of items an insertion moves along a chain once the one-step movements fail
+    uint8_t least_loaded;                 // "1": an item goes to the candidate bucket with more empty slots, "0": to the first empty slot found
+                                          // checking its two candidate buckets alternately slot by slot
+    uint32_t stash_num;                   // The number of items in the stash
+    uint64_t stash_hint;                  // Bit (s_hash >> 58) is set for each stashed item, so that a search missing both levels
+                                          // reads the stash only if the bit of its key is set
+    level_stash_item stash[STASH_SIZE];   // The items whose insertion failed after all movements, until the next expansion
+    level_alloc_policy alloc_policy;      // How the levels are allocated; set by level_init() to the compile-time defaults and used by later resizing
+#ifdef VAR_ITEM
+    level_arena arena;                    // The out-of-line records of the items
+#endif
+    uint8_t auto_resize;                  // "1": insertions expand and deletions shrink the table by the watermarks below, "0": the caller resizes it
+    double grow_watermark;                // The load factor at which an insertion expands the table first
+    double shrink_watermark;              // The load factor under which a deletion shrinks the table
+    uint64_t min_level_size;              // The table is never shrunk below its initial level_size
+    double prefault_watermark;            // The load factor at which a thread starts allocating and pre-faulting the next top level
+    uint8_t prefault_state;               // "1": the prefault thread was started and not yet joined, "0": no prefault thread
+    pthread_t prefault_thread;
+    level_bucket *prefault_buckets;       // The pre-faulted level, valid once the prefault thread is joined
+    uint64_t prefault_capacity;           // The number of buckets in the pre-faulted level
 } level_hash;
 
 level_hash *level_init(uint64_t level_size);     
 
+level_hash *level_init_seeds(uint64_t level_size, uint64_t f_seed, uint64_t s_seed);
+
 uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value);          
 
 uint8_t* level_static_query(level_hash *level, uint8_t *key);
 
 uint8_t* level_dynamic_query(level_hash *level, uint8_t *key);
 
+void level_multi_query(level_hash *level, uint8_t *keys[], uint64_t n, uint8_t *values[]);
+
+void level_interleaved_query(level_hash *level, uint8_t *keys[], uint64_t n, uint8_t *values[]);
+
+void level_interleaved_insert(level_hash *level, uint8_t *keys[], uint8_t *values[], uint64_t n, uint8_t results[]);
+
 uint8_t level_delete(level_hash *level, uint8_t*key);
 
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value);
 
+#ifdef VAR_ITEM
+uint8_t level_insert_var(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *value, uint32_t value_len);
+
+uint8_t* level_query_var(level_hash *level, uint8_t *key, uint32_t key_len, uint32_t *value_len);
+
+uint8_t level_delete_var(level_hash *level, uint8_t *key, uint32_t key_len);
+
+uint8_t level_update_var(level_hash *level, uint8_t *key, uint32_t key_len, uint8_t *new_value, uint32_t value_len);
+#endif
+
 void level_expand(level_hash *level);
 
 void level_shrink(level_hash *level);
 
-uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_t *key, uint8_t *value);
+uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, entry *item, uint64_t f_hash, uint64_t s_hash, uint8_t fp);
 
 int b2t_movement(level_hash *level, uint64_t idx);
 
@@ -0,0 +1,161 @@
+#include "level_shard.h"
+
+/*
+Function: shard_key_size()
+        Return the length of a key passed to the functions taking fixed-size keys
+*/
+static inline uint32_t shard_key_size(const uint8_t *key) {
+#if defined(INTEGER_KEY) || defined(BINARY_KEY)
+    return KEY_LEN;
+#else
+    return strlen(key);
+#endif
+}
+
+/*
+Function: shard_rand()
+        Return a 64-bit random number from three draws of rand()
+*/
+static inline uint64_t shard_rand()
+{
+    return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
+/*
+Function: level_shard_init() 
+        Initialize a sharded level hash table of 2^shard_bits shards with 2^level_size top-level buckets each;
+        The shards resize themselves, and their grow watermarks are spread over SHARD_STAGGER below GROW_WATERMARK
+        so that shards filled at the same rate do not expand one right after another
+*/
+level_shard_hash *level_shard_init(uint32_t shard_bits, uint64_t level_size)
+{
+    level_shard_hash *shard = malloc(sizeof(level_shard_hash));
+    if (!shard || shard_bits > 16)
+    {
+        printf("The sharded level hash table initialization fails:1\n");
+        exit(1);
+    }
+
+    uint64_t i, shard_num = 1UL << shard_bits;
+    shard->shard_bits = shard_bits;
+    shard->shards = malloc(shard_num*sizeof(level_hash *));
+    if (!shard->shards)
+    {
+        printf("The sharded level hash table initialization fails:2\n");
+        exit(1);
+    }
+
+    // All shards are seeded from one srand(), since level_init() reseeds rand() from the clock and shards created
+    // in the same second would share their seeds; multiplying the shard number by an odd constant is a bijection,
+    // so the seeds of the shards are distinct, and f_seed ^ s_seed is the same nonzero value in every shard
+    srand(time(NULL));
+    uint64_t f_seed = shard_rand(), s_seed;
+    do
+    {
+        s_seed = shard_rand();
+    } while (s_seed == f_seed);
+
+    for (i = 0; i < shard_num; i ++)
+    {
+        shard->shards[i] = level_init_seeds(level_size, f_seed ^ (i*SHARD_SEED_STEP), s_seed ^ (i*SHARD_SEED_STEP));
+        shard->shards[i]->auto_resize = 1;
+        shard->shards[i]->grow_watermark = GROW_WATERMARK - SHARD_STAGGER*i/shard_num;
+    }
+
+    // The routing hash must be independent of the hash locations and fingerprints inside all shards
+    do
+    {
+        shard->seed = shard_rand();
+        for (i = 0; i < shard_num; i ++)
+            if (shard->seed == shard->shards[i]->f_seed || shard->seed == shard->shards[i]->s_seed)
+                break;
+    } while (i < shard_num);
+
+    printf("Level hashing: ASSOC_NUM %d, KEY_LEN %d, VALUE_LEN %d \n", ASSOC_NUM, KEY_LEN, VALUE_LEN);
+    printf("The sharded level hash table initialization succeeds: %ld shards of %ld top-level buckets\n", shard_num, shard->shards[0]->addr_capacity);
+    return shard;
+}
+
+/*
+Function: level_shard_route() 
+        Return the shard holding a key, e.g., to call the other functions of level hashing on it
+*/
+level_hash *level_shard_route(level_shard_hash *shard, uint8_t *key, uint32_t key_len)
+{
+    if (shard->shard_bits == 0)
+        return shard->shards[0];
+    return shard->shards[hash(key, key_len, shard->seed) >> (64 - shard->shard_bits)];
+}
+
+/*
+Function: level_shard_insert() 
+        Insert a key-value item into its shard, which expands first if it is full;
+*/
+uint8_t level_shard_insert(level_shard_hash *shard, uint8_t *key, uint8_t *value)
+{
+    return level_insert(level_shard_route(shard, key, shard_key_size(key)), key, value);
+}
+
+/*
+Function: level_shard_static_query() 
+        Lookup a key-value item in its shard via static search scheme;
+*/
+uint8_t* level_shard_static_query(level_shard_hash *shard, uint8_t *key)
+{
+    return level_static_query(level_shard_route(shard, key, shard_key_size(key)), key);
+}
+
+/*
+Function: level_shard_dynamic_query() 
+        Lookup a key-value item in its shard via dynamic search scheme;
+*/
+uint8_t* level_shard_dynamic_query(level_shard_hash *shard, uint8_t *key)
+{
+    return level_dynamic_query(level_shard_route(shard, key, shard_key_size(key)), key);
+}
+
+/*
+Function: level_shard_delete() 
+        Remove a key-value item from its shard, which may shrink afterwards;
+*/
+uint8_t level_shard_delete(level_shard_hash *shard, uint8_t *key)
+{
+    return level_delete(level_shard_route(shard, key, shard_key_size(key)), key);
+}
+
+/*
+Function: level_shard_update() 
+        Update the value of a key-value item in its shard;
+*/
+uint8_t level_shard_update(level_shard_hash *shard, uint8_t *key, uint8_t *new_value)
+{
+    return level_update(level_shard_route(shard, key, shard_key_size(key)), key, new_value);
+}
+
+/*
+Function: level_shard_item_num() 
+        Return the number of items stored in all shards
+*/
+uint64_t level_shard_item_num(level_shard_hash *shard)
+{
+    uint64_t i, item_num = 0;
+    for (i = 0; i < (1UL << shard->shard_bits); i ++)
+        item_num += shard->shards[i]->level_item_num[0] + shard->shards[i]->level_item_num[1] + shard->shards[i]->level_item_num[2] + shard->shards[i]->stash_num;
+    return item_num;
+}
+
+/*
+Function: level_shard_destroy() 
+        Destroy a sharded level hash table and all its shards
+*/
+void level_shard_destroy(level_shard_hash *shard)
+{
+    uint64_t i;
+    for (i = 0; i < (1UL << shard->shard_bits); i ++)
+    {
+        level_destroy(shard->shards[i]);
+        free(shard->shards[i]);
+    }
+    free(shard->shards);
+    free(shard);
+}
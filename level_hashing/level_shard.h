@@ -0,0 +1,31 @@
+#include "level_hashing.h"
+
+#ifndef SHARD_STAGGER
+#define SHARD_STAGGER 0.1                 // The spread of the grow watermarks of the shards below GROW_WATERMARK, so that they expand at different times
+#endif
+
+#define SHARD_SEED_STEP 0x9E3779B97F4A7C15UL  // An odd constant whose multiples by the shard number make the seeds of the shards distinct
+
+typedef struct level_shard_hash {         // A sharded Level hash table routing each key by the high bits of a hash to one of its shards
+    uint32_t shard_bits;                  // The number of shards is 2^shard_bits
+    uint64_t seed;                        // The seed of the routing hash, distinct from the seeds of the shards
+    level_hash **shards;                  // Independent level hash tables, each resizing itself
+} level_shard_hash;
+
+level_shard_hash *level_shard_init(uint32_t shard_bits, uint64_t level_size);
+
+level_hash *level_shard_route(level_shard_hash *shard, uint8_t *key, uint32_t key_len);
+
+uint8_t level_shard_insert(level_shard_hash *shard, uint8_t *key, uint8_t *value);
+
+uint8_t* level_shard_static_query(level_shard_hash *shard, uint8_t *key);
+
+uint8_t* level_shard_dynamic_query(level_shard_hash *shard, uint8_t *key);
+
+uint8_t level_shard_delete(level_shard_hash *shard, uint8_t *key);
+
+uint8_t level_shard_update(level_shard_hash *shard, uint8_t *key, uint8_t *new_value);
+
+uint64_t level_shard_item_num(level_shard_hash *shard);
+
+void level_shard_destroy(level_shard_hash *shard);
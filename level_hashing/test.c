@@ -1,20 +1,97 @@
-#include "level_hashing.h"
+#include "level_shard.h"
+
+/*  Benchmark:
+    Fill a table until an item first finds no slot in its buckets, i.e., it goes to the stash, and return the
+    load factor; set the average number of buckets a static search probes to find a stored item
+*/
+static double bench_first_failure(int level_size, uint8_t least_loaded, uint32_t displace_depth, uint64_t first_key, double *probe_len)
+{
+    level_hash *level = level_init(level_size);
+    level->least_loaded = least_loaded;
+    level->displace_depth = displace_depth;
+    level->prefault_watermark = 0;
+    uint8_t key[KEY_LEN], value[VALUE_LEN];
+    uint64_t i, j, k, n;
+
+    for (i = first_key; ; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        if (level_insert(level, key, value) || level->stash_num)
+            break;
+    }
+    double load = (double)(level->level_item_num[0]+level->level_item_num[1])/(level->total_capacity*ASSOC_NUM);
+
+    // The first hash location of a level is in its first half and the second one in its second half
+    double probes = 0;
+    for (n = 0; n < 2; n ++)
+    {
+        for (j = 0; j < level->addr_capacity >> n; j ++)
+        {
+            for (k = 0; k < ASSOC_NUM; k ++)
+            {
+                if (level->buckets[n][j].token[k] != 0)
+                    probes += 2*n + (j >= (level->addr_capacity >> n)/2) + 1;
+            }
+        }
+    }
+    *probe_len = probes/(level->level_item_num[0]+level->level_item_num[1]);
+    level_destroy(level);
+    free(level);
+    return load;
+}
+
+/*  Benchmark:
+    Print the load factor at the first insertion failure and the average probe length of positive searches,
+    with first-empty-slot and least-loaded placement and with the displacement search off and on,
+    averaged over the same keys in several tables
+*/
+static void run_bench(int level_size, int run_num)
+{
+    uint32_t depth[2] = {0, DISPLACE_DEPTH};
+    int l, d, r;
+    for (d = 0; d < 2; d ++)
+    {
+        for (l = 0; l < 2; l ++)
+        {
+            double load = 0, probe_len = 0, run_probe_len;
+            for (r = 0; r < run_num; r ++)
+            {
+                load += bench_first_failure(level_size, l, depth[d], (uint64_t)r*100000000 + 1, &run_probe_len);
+                probe_len += run_probe_len;
+            }
+            printf("BENCH least_loaded %d, displace_depth %u: first-failure load factor %.3f, average probed buckets %.3f\n", \
+                l, depth[d], load/run_num, probe_len/run_num);
+        }
+    }
+}
 
 /*  Test:
-    This is a simple test example to test the creation, insertion, search, deletion, update in Level hashing
+    This is a simple test example to test the creation, insertion, search, deletion, update in Level hashing;
+    "./level bench <level_size> [runs]" runs the benchmark of the first-failure load factor and probe length instead
 */
 int main(int argc, char* argv[])                        
 {
+    if (argc > 2 && strcmp(argv[1], "bench") == 0)
+    {
+        run_bench(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : 5);
+        return 0;
+    }
+
     int level_size = atoi(argv[1]);                     // INPUT: the number of addressable buckets is 2^level_size
     int insert_num = atoi(argv[2]);                     // INPUT: the number of items to be inserted
+    int expand_thread_num = argc > 3 ? atoi(argv[3]) : EXPAND_THREAD_NUM;   // INPUT (optional): the number of threads rehashing during an expansion
 
     level_hash *level = level_init(level_size);
+    level->expand_thread_num = expand_thread_num;
     uint64_t inserted = 0, i = 0;
     uint8_t key[KEY_LEN];
     uint8_t value[VALUE_LEN];
 
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         snprintf(value, VALUE_LEN, "%ld", i);
         if (!level_insert(level, key, value))                               
@@ -26,6 +103,8 @@ int main(int argc, char* argv[])
                 (float)(level->level_item_num[0]+level->level_item_num[1])/(level->total_capacity*ASSOC_NUM), \
                 level->total_capacity*ASSOC_NUM);
             level_expand(level);
+            printf("Expanding with %d threads: allocation %fs, rehashing %fs, commit %fs\n", expand_thread_num, \
+                level->expand_stats.alloc_time, level->expand_stats.rehash_time, level->expand_stats.commit_time);
             level_insert(level, key, value);
             inserted ++;
         }
@@ -35,6 +114,7 @@ int main(int argc, char* argv[])
     printf("The static search test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         uint8_t* get_value = level_static_query(level, key);
         if(get_value == NULL)
@@ -44,15 +124,37 @@ int main(int argc, char* argv[])
     printf("The dynamic search test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         uint8_t* get_value = level_dynamic_query(level, key);
         if(get_value == NULL)
             printf("Search the key %s: ERROR! \n", key);
    }
 
+    printf("The batched search test begins ...\n");
+    uint8_t batch_key[64][KEY_LEN];
+    uint8_t *batch_keys[64], *batch_values[64];
+    for (i = 1; i < insert_num + 1; i += 64)
+    {
+        uint64_t k, n = insert_num + 1 - i < 64 ? insert_num + 1 - i : 64;
+        for (k = 0; k < n; k ++)
+        {
+            memset(batch_key[k], 0, KEY_LEN);
+            snprintf(batch_key[k], KEY_LEN, "%ld", i + k);
+            batch_keys[k] = batch_key[k];
+        }
+        level_multi_query(level, batch_keys, n, batch_values);
+        for (k = 0; k < n; k ++)
+        {
+            if(batch_values[k] == NULL)
+                printf("Search the key %s: ERROR! \n", batch_key[k]);
+        }
+   }
+
     printf("The update test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         snprintf(value, VALUE_LEN, "%ld", i*2);
         if(level_update(level, key, value))
@@ -62,12 +164,255 @@ int main(int argc, char* argv[])
     printf("The deletion test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if(level_delete(level, key))
+            printf("Delete the key %s: ERROR! \n", key);
+   }
+
+    printf("The interleaved insertion and search test begins ...\n");
+    uint8_t batch_results[64];
+    uint8_t batch_value[64][VALUE_LEN];
+    for (i = 1; i < insert_num + 1; i += 64)
+    {
+        uint64_t k, n = insert_num + 1 - i < 64 ? insert_num + 1 - i : 64;
+        for (k = 0; k < n; k ++)
+        {
+            memset(batch_key[k], 0, KEY_LEN);
+            snprintf(batch_key[k], KEY_LEN, "%ld", i + k);
+            snprintf(batch_value[k], VALUE_LEN, "%ld", i + k);
+            batch_keys[k] = batch_key[k];
+            batch_values[k] = batch_value[k];
+        }
+        level_interleaved_insert(level, batch_keys, batch_values, n, batch_results);
+        for (k = 0; k < n; k ++)
+        {
+            while (batch_results[k])
+            {
+                level_expand(level);
+                batch_results[k] = level_insert(level, batch_key[k], batch_value[k]);
+            }
+        }
+        level_interleaved_query(level, batch_keys, n, batch_values);
+        for (k = 0; k < n; k ++)
+        {
+            if(batch_values[k] == NULL)
+                printf("Search the key %s: ERROR! \n", batch_key[k]);
+        }
+   }
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         if(level_delete(level, key))
             printf("Delete the key %s: ERROR! \n", key);
    }
 
-    printf("The number of items stored in the level hash table: %ld\n", level->level_item_num[0]+level->level_item_num[1]);    
+    printf("The number of items stored in the level hash table: %ld\n", level->level_item_num[0]+level->level_item_num[1]);
+
+    printf("The automatic resizing test begins ...\n");
+    level->auto_resize = 1;
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        if (level_insert(level, key, value))
+            printf("Insert the key %s: ERROR! \n", key);
+    }
+    printf("The level size after the insertions: %ld\n", level->level_size);
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if(level_static_query(level, key) == NULL)
+            printf("Search the key %s: ERROR! \n", key);
+        if(level_delete(level, key))
+            printf("Delete the key %s: ERROR! \n", key);
+    }
+    printf("The level size after the deletions: %ld\n", level->level_size);
+    level->auto_resize = 0;
+
+    printf("The incremental expansion test begins ...\n");
+    level->incremental_expand = 1;
+    struct timespec start, finish;
+    double insert_time, max_insert_time = 0;
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (level_insert(level, key, value))
+            level_expand(level);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        insert_time = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        if (insert_time > max_insert_time)
+            max_insert_time = insert_time;
+        if (level_static_query(level, key) == NULL)
+            printf("Search the key %s during the migration: ERROR! \n", key);
+    }
+    printf("The longest insertion took %fs; %ld items are still in the old bottom level\n", max_insert_time, level->level_item_num[2]);
+    for (i = 1; i < insert_num + 1; i += 64)
+    {
+        uint64_t k, n = insert_num + 1 - i < 64 ? insert_num + 1 - i : 64;
+        for (k = 0; k < n; k ++)
+        {
+            memset(batch_key[k], 0, KEY_LEN);
+            snprintf(batch_key[k], KEY_LEN, "%ld", i + k);
+            batch_keys[k] = batch_key[k];
+        }
+        level_interleaved_query(level, batch_keys, n, batch_values);
+        for (k = 0; k < n; k ++)
+        {
+            if(batch_values[k] == NULL || level_dynamic_query(level, batch_key[k]) == NULL)
+                printf("Search the key %s during the migration: ERROR! \n", batch_key[k]);
+        }
+    }
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if(level_delete(level, key))
+            printf("Delete the key %s: ERROR! \n", key);
+    }
+    printf("The number of items stored in the level hash table: %ld\n", level->level_item_num[0]+level->level_item_num[1]+level->level_item_num[2]);
+    level->incremental_expand = 0;
+
+    printf("The stash test begins ...\n");
+    level_hash *small = level_init(4);
+    small->displace_depth = 0;
+    for (i = 1; ; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        if (level_insert(small, key, value))
+            break;
+    }
+    uint64_t small_num = i - 1;
+    printf("%ld items are inserted before the first failure, %d of them in the stash\n", small_num, small->stash_num);
+    if (small->stash_num != STASH_SIZE)
+        printf("Fill the stash: ERROR! \n");
+    for (i = 1; i < small_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if (level_static_query(small, key) == NULL || level_dynamic_query(small, key) == NULL)
+            printf("Search the key %s with a full stash: ERROR! \n", key);
+        if (i % 2 == 0 && (level_delete(small, key) || level_static_query(small, key) != NULL))
+            printf("Delete the key %s with a full stash: ERROR! \n", key);
+    }
+    level_expand(small);
+    if (small->stash_num != 0)
+        printf("Drain the stash: ERROR! \n");
+    for (i = 1; i < small_num + 1; i += 2)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if (level_static_query(small, key) == NULL)
+            printf("Search the key %s after draining the stash: ERROR! \n", key);
+        if (level_delete(small, key))
+            printf("Delete the key %s: ERROR! \n", key);
+    }
+    level_destroy(small);
+    free(small);
+
+    // A shrinking must insert the stashed items into the new levels, as an expansion does
+    small = level_init(4);
+    small->displace_depth = 0;
+    uint64_t stashed[STASH_SIZE], j;
+    uint32_t stash_num = 0;
+    for (i = 1; ; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        if (level_insert(small, key, value))
+            break;
+        if (small->stash_num > stash_num)
+            stashed[stash_num ++] = i;
+    }
+    small_num = i - 1;
+    for (i = 1, j = 0; i < small_num + 1; i ++)
+    {
+        if (j < stash_num && stashed[j] == i) {
+            j ++;
+            continue;
+        }
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        if (level_delete(small, key))
+            printf("Delete the key %s with a full stash: ERROR! \n", key);
+    }
+    level_shrink(small);
+    if (small->stash_num != 0)
+        printf("Drain the stash by a shrinking: ERROR! \n");
+    for (j = 0; j < stash_num; j ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", stashed[j]);
+        if (level_static_query(small, key) == NULL)
+            printf("Search the key %s after shrinking: ERROR! \n", key);
+    }
+    level_destroy(small);
+    free(small);
+
+    printf("The sharded table test begins ...\n");
+    level_shard_hash *shard = level_shard_init(2, level_size > 2 ? level_size - 2 : 1);
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        snprintf(value, VALUE_LEN, "%ld", i);
+        if (level_shard_insert(shard, key, value))
+            printf("Insert the key %s into a shard: ERROR! \n", key);
+    }
+    for (i = 0; i < 4; i ++)
+        printf("Shard %ld: level size %ld, %ld items\n", i, shard->shards[i]->level_size, \
+            shard->shards[i]->level_item_num[0]+shard->shards[i]->level_item_num[1]);
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        memset(key, 0, KEY_LEN);
+        snprintf(key, KEY_LEN, "%ld", i);
+        uint8_t* get_value = level_shard_static_query(shard, key);
+        if(get_value == NULL || strcmp(get_value, key))
+            printf("Search the key %s in a shard: ERROR! \n", key);
+        if(level_shard_delete(shard, key))
+            printf("Delete the key %s from a shard: ERROR! \n", key);
+    }
+    printf("The number of items stored in the sharded table: %ld\n", level_shard_item_num(shard));
+    level_shard_destroy(shard);
+
+#ifdef VAR_ITEM
+    printf("The variable-length item test begins ...\n");
+    uint8_t var_key[64], var_value[256];
+    uint32_t key_len, value_len, get_len;
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        key_len = snprintf(var_key, sizeof(var_key), "%0*ld", (int)(i % 48) + 1, i);
+        value_len = i % sizeof(var_value);
+        memset(var_value, (uint8_t)i, value_len);
+        while (level_insert_var(level, var_key, key_len, var_value, value_len))
+            level_expand(level);
+    }
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        key_len = snprintf(var_key, sizeof(var_key), "%0*ld", (int)(i % 48) + 1, i);
+        uint8_t* get_value = level_query_var(level, var_key, key_len, &get_len);
+        if(get_value == NULL || get_len != i % sizeof(var_value) || (get_len && get_value[get_len-1] != (uint8_t)i))
+            printf("Search the variable-length key %s: ERROR! \n", var_key);
+        if(level_update_var(level, var_key, key_len, var_key, key_len))
+            printf("Update the variable-length key %s: ERROR! \n", var_key);
+        get_value = level_query_var(level, var_key, key_len, &get_len);
+        if(get_value == NULL || get_len != key_len || memcmp(get_value, var_key, key_len))
+            printf("Search the updated variable-length key %s: ERROR! \n", var_key);
+        if(i % 2 && level_delete_var(level, var_key, key_len))
+            printf("Delete the variable-length key %s: ERROR! \n", var_key);
+    }
+    printf("The number of items stored in the level hash table: %ld\n", level->level_item_num[0]+level->level_item_num[1]);
+#endif
+
     level_destroy(level);
 
     return 0;
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "hash.h"
 
 #define NUMBER64_1 11400714785074694791ULL
@@ -5,6 +6,8 @@
 #define NUMBER64_3 1609587929392839161ULL
 #define NUMBER64_4 9650029242287828579ULL
 #define NUMBER64_5 2870177450012600261ULL
+#define NUMBER128_1 0x87c37b91114253d5ULL
+#define NUMBER128_2 0x4cf5ad432745937fULL
 
 #define hash_get64bits(x) hash_read64_align(x, align)
 #define hash_get32bits(x) hash_read32_align(x, align)
@@ -154,3 +157,106 @@ uint64_t hash(const void *data, uint64_t length, uint64_t seed)
     }
     return string_key_hash_computation(data, length, seed, 0);
 }
+
+/*
+Function: hash_mix() 
+        The finalization mix that makes every bit of a 64-bit hash value depend on every bit of its input
+*/
+static inline uint64_t hash_mix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*
+Function: hash_128() 
+        Compute a 128-bit hash value of a string key in a single pass (MurmurHash3_x64_128),
+        with the two 64-bit halves seeded by f_seed and s_seed respectively
+*/
+void hash_128(const void *data, uint64_t length, uint64_t f_seed, uint64_t s_seed, uint64_t *hash_value)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + (length & ~15ULL);
+    uint64_t h1 = f_seed, h2 = s_seed;
+    uint64_t k1, k2, i;
+
+    for (; p < end; p += 16)
+    {
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= NUMBER128_1;
+        k1 = shifting_hash(k1, 31);
+        k1 *= NUMBER128_2;
+        h1 ^= k1;
+        h1 = shifting_hash(h1, 27) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= NUMBER128_2;
+        k2 = shifting_hash(k2, 33);
+        k2 *= NUMBER128_1;
+        h2 ^= k2;
+        h2 = shifting_hash(h2, 31) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = 0;
+    k2 = 0;
+    for (i = 0; i < (length & 15); i ++)
+    {
+        if (i < 8)
+            k1 ^= (uint64_t)p[i] << (8 * i);
+        else
+            k2 ^= (uint64_t)p[i] << (8 * (i - 8));
+    }
+    if ((length & 15) > 8)
+    {
+        k2 *= NUMBER128_2;
+        k2 = shifting_hash(k2, 33);
+        k2 *= NUMBER128_1;
+        h2 ^= k2;
+    }
+    if ((length & 15) > 0)
+    {
+        k1 *= NUMBER128_1;
+        k1 = shifting_hash(k1, 31);
+        k1 *= NUMBER128_2;
+        h1 ^= k1;
+    }
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash_mix(h1);
+    h2 = hash_mix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash_value[0] = h1;
+    hash_value[1] = h2;
+}
+
+/*
+Function: hash_integer() 
+        Compute two independent hash values of an 8-byte integer key: Thomas Wang's 64-bit variant of 
+        Jenkins' integer hash with the seed f_seed, and the murmur3 finalizer with the seed s_seed
+*/
+void hash_integer(uint64_t key, uint64_t f_seed, uint64_t s_seed, uint64_t *hash_value)
+{
+    uint64_t hash = key ^ f_seed;
+    hash = (~hash) + (hash << 21);
+    hash ^= hash >> 24;
+    hash = (hash + (hash << 3)) + (hash << 8);
+    hash ^= hash >> 14;
+    hash = (hash + (hash << 2)) + (hash << 4);
+    hash ^= hash >> 28;
+    hash += hash << 31;
+
+    hash_value[0] = hash;
+    hash_value[1] = hash_mix(key ^ s_seed);
+}
@@ -1,19 +1,39 @@
 #include "level_hashing.h"
 
 /*
-Function: F_HASH()
-        Compute the first hash value of a key-value item
+Function: FS_HASH()
+        Compute the first and second hash values of a key-value item in a single pass
 */
-uint64_t F_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->f_seed));
+void FS_HASH(level_hash *level, const uint8_t *key, uint64_t *f_hash, uint64_t *s_hash) {
+    uint64_t hash_value[2];
+#if defined(INTEGER_KEY)
+    uint64_t int_key;
+    memcpy(&int_key, key, sizeof(uint64_t));
+    hash_integer(int_key, level->f_seed, level->s_seed, hash_value);
+#elif defined(BINARY_KEY)
+    hash_128((void *)key, KEY_LEN, level->f_seed, level->s_seed, hash_value);
+#else
+    hash_128((void *)key, strlen(key), level->f_seed, level->s_seed, hash_value);
+#endif
+    *f_hash = hash_value[0];
+    *s_hash = hash_value[1];
 }
 
 /*
-Function: S_HASH() 
-        Compute the second hash value of a key-value item
+Function: KEY_EQUAL()
+        Determine whether two keys are equal according to the type of keys;
 */
-uint64_t S_HASH(level_hash *level, const uint8_t *key) {
-    return (hash((void *)key, strlen(key), level->s_seed));
+static inline int KEY_EQUAL(const uint8_t *key1, const uint8_t *key2) {
+#if defined(INTEGER_KEY)
+    uint64_t int_key1, int_key2;
+    memcpy(&int_key1, key1, sizeof(uint64_t));
+    memcpy(&int_key2, key2, sizeof(uint64_t));
+    return int_key1 == int_key2;
+#elif defined(BINARY_KEY)
+    return memcmp(key1, key2, KEY_LEN) == 0;
+#else
+    return strcmp(key1, key2) == 0;
+#endif
 }
 
 /*
@@ -21,7 +41,7 @@ Function: F_IDX()
         Compute the second hash location
 */
 uint64_t F_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2);
+    return hashKey & (capacity / 2 - 1);
 }
 
 /*
@@ -29,7 +49,7 @@ Function: S_IDX()
         Compute the second hash location
 */
 uint64_t S_IDX(uint64_t hashKey, uint64_t capacity) {
-    return hashKey % (capacity / 2) + capacity / 2;
+    return (hashKey & (capacity / 2 - 1)) + capacity / 2;
 }
 
 /*
@@ -50,18 +70,33 @@ void generate_seeds(level_hash *level)
 
 /*
 Function: is_in_one_cache_line
-          determine whether x and y are in the same cache line
+          determine whether the len bytes at x and the token at y are in the same cache line
 */
-static inline bool is_in_one_cache_line(void* x, void* y)
+static inline bool is_in_one_cache_line(void* x, size_t len, void* y)
 {
-    if((char*)x + 64 <= (char*)y)
-    {
-        return false;
-    }
-    else
+    uint64_t line = (uint64_t)y / CACHE_LINE_SIZE;
+    return (uint64_t)x / CACHE_LINE_SIZE == line && ((uint64_t)x + len - 1) / CACHE_LINE_SIZE == line;
+}
+
+/*
+Function: level_slot_publish
+          persist the j-th slot in the bucket and then install the new token;
+          the caller issues the fence that makes the token durable
+*/
+static inline void level_slot_publish(level_bucket* bucket, uint64_t j, uint32_t token)
+{
+    persist_plan plan = PPLAN_INIT;
+
+    // When the key-value item and token are in the same cache line, the line is flushed only once and no fence is needed in between.
+    pplan_add(&plan, &bucket->slot[j], sizeof(entry));
+    if(!is_in_one_cache_line(&bucket->slot[j], sizeof(entry), &bucket->token))
     {
-        return true;
+        pplan_flush(&plan);
+        pfence();
     }
+    bucket->token = token;
+    pplan_add(&plan, &bucket->token, sizeof(uint32_t));
+    pplan_flush(&plan);
 }
 
 /*
@@ -70,30 +105,87 @@ Function: level_slot_flush
 */
 static inline void level_slot_flush(level_bucket* bucket, uint64_t j)
 {
-    // When the key-value item and token are in the same cache line, only one flush is acctually executed.
-    if(is_in_one_cache_line(&bucket->slot[j], &bucket->token))
-    {
-        SET_BIT(bucket->token, j, 1);
-        pflush((uint64_t *)&bucket->slot[j].key);
-        pflush((uint64_t *)&bucket->slot[j].value);
-    }
-    else
-    {
-        pflush((uint64_t *)&bucket->slot[j].key);
-        pflush((uint64_t *)&bucket->slot[j].value);
-        asm_mfence();
-        SET_BIT(bucket->token, j, 1);                   
+    level_slot_publish(bucket, j, bucket->token | (1<<j));
+}
+
+/*
+Function: level_meta_flush
+          persist all the cache lines of the level hash table header
+*/
+static inline void level_meta_flush(level_hash *level)
+{
+    persist_plan plan = PPLAN_INIT;
+    pplan_add(&plan, level, sizeof(level_hash));
+    pplan_flush(&plan);
+    pfence();
+}
+
+/*
+Function: level_count_flush
+          flush the item counters, which share the first cache line of the table header;
+          the next fence of the operation makes them durable together with its tokens
+*/
+static inline void level_count_flush(level_hash *level)
+{
+    pflush((uint64_t *)level->level_item_num);
+}
+
+/*
+Function: level_find_slot
+          return the slot holding the key in a bucket, or -1 if the bucket does not hold it
+*/
+static inline int level_find_slot(level_bucket *bucket, uint8_t *key)
+{
+    int j;
+    for(j = 0; j < ASSOC_NUM; j ++){
+        if (GET_BIT(bucket->token, j) != 0&&KEY_EQUAL(bucket->slot[j].key, key))
+            return j;
     }
-    pflush((uint64_t *)&bucket->token);
+    return -1;
+}
+
+/*
+Function: level_attach
+          derive the volatile addresses of the levels and the log from their pool offsets
+*/
+static void level_attach(level_hash *level)
+{
+    level->buckets[0] = pdirect(level->buckets_off[0]);
+    level->buckets[1] = pdirect(level->buckets_off[1]);
+    level->interim_level_buckets = pdirect(level->interim_level_off);
+    level->log = pdirect(level->log_off);
+    log_attach(level->log);
+}
+
+/*
+Function: level_pool_size() 
+        Return the pool size a table needs to grow to level_size: the levels freed by earlier expansions are 
+        too small to hold the next top level, so all the levels allocated since the table was created, i.e., 
+        less than twice the top level of level_size, are counted, plus the logs and 1/8 for the allocator
+*/
+static uint64_t level_pool_size(uint64_t level_size)
+{
+    uint64_t pool_size = pow(2, level_size + 1)*sizeof(level_bucket)
+                       + 1024*(sizeof(log_entry) + sizeof(log_entry_insert));
+    return pool_size + pool_size/8;
 }
 
 /*
 Function: level_init() 
-        Initialize a level hash table
+        Initialize a level hash table;
+        A new pool is sized for POOL_EXPAND_NUM expansions, while an existing pool keeps its size, 
+        and max_level_size is derived from the size of the pool
 */
 level_hash *level_init(const char *fname, uint64_t level_size)
 {
-    init_pmalloc(fname);
+    uint64_t pool_size = init_pmalloc(fname, level_pool_size(level_size + POOL_EXPAND_NUM));
+    if (pool_size < level_pool_size(level_size))
+    {
+        printf("The level hash table initialization fails: the pool of %ld bytes has no room for 2^%ld top-level buckets\n", \
+            pool_size, level_size);
+        exit(1);
+    }
+
     level_hash *level = pmalloc_lvl(sizeof(level_hash));
     if (!level)
     {
@@ -102,28 +194,39 @@ level_hash *level_init(const char *fname, uint64_t level_size)
     }
 
     level->level_size = level_size;
+    level->max_level_size = level_size;
+    while (level_pool_size(level->max_level_size + 1) <= pool_size)
+        level->max_level_size ++;
     level->addr_capacity = pow(2, level_size);
     level->total_capacity = pow(2, level_size) + pow(2, level_size - 1);
     generate_seeds(level);
-    level->buckets[0] = pmalloc_lvl(pow(2, level_size)*sizeof(level_bucket));
-    level->buckets[1] = pmalloc_lvl(pow(2, level_size - 1)*sizeof(level_bucket));
-    level->interim_level_buckets = NULL;
+    level->buckets_off[0] = poffset(pmalloc_lvl(pow(2, level_size)*sizeof(level_bucket)));
+    level->buckets_off[1] = poffset(pmalloc_lvl(pow(2, level_size - 1)*sizeof(level_bucket)));
+    level->interim_level_off = 0;
     level->level_item_num[0] = 0;
     level->level_item_num[1] = 0;
     level->level_expand_time = 0;
     level->resize_state = 0;
 
-    if (!level->buckets[0] || !level->buckets[1])
+    if (!level->buckets_off[0] || !level->buckets_off[1])
     {
         printf("The level hash table initialization fails:2\n");
         exit(1);
     }
 
-    level->log = log_create(1024);
+    level->resize_progress = 0;
+    level->interim_item_num = 0;
 
-    uint64_t *ptr = (uint64_t *)&level;
-    for(; ptr < (uint64_t *)&level + sizeof(level_hash); ptr += 8)
-        pflush((uint64_t *)&ptr);
+    level->log_off = poffset(log_create(1024));
+    level_attach(level);
+    level->expand_thread_num = EXPAND_THREAD_NUM;
+    memset(&level->expand_stats, 0, sizeof(level_expand_stats));
+    level->auto_resize = 0;
+    level->grow_watermark = GROW_WATERMARK;
+    level->shrink_watermark = SHRINK_WATERMARK;
+    level->min_level_size = level->level_size;
+    level_meta_flush(level);
+    pset_root(level);
 
     printf("Level hashing: ASSOC_NUM %d, KEY_LEN %d, VALUE_LEN %d \n", ASSOC_NUM, KEY_LEN, VALUE_LEN);
     printf("The number of top-level buckets: %ld\n", level->addr_capacity);
@@ -134,32 +237,96 @@ level_hash *level_init(const char *fname, uint64_t level_size)
 }
 
 /*
-Function: level_expand()
-        Expand a level hash table in place;
-        Put a new level on the top of the old hash table and only rehash the
-        items in the bottom level of the old hash table;
+Function: level_open() 
+        Attach to the level hash table stored in an existing pool without touching its buckets;
+        Only the addresses derived from pool offsets are refreshed, then the table is recovered 
+        in case the last run crashed; return NULL without any message if there is no pool or 
+        the pool holds no table, so that the caller can create one with level_init()
 */
-void level_expand(level_hash *level) 
+level_hash *level_open(const char *fname)
 {
+    if (open_pmalloc(fname))
+        return NULL;
+
+    level_hash *level = pget_root();
     if (!level)
     {
-        printf("The expanding fails: 1\n");
-        exit(1);
+        close_pmalloc();                  // level_init() maps the pool again
+        return NULL;
     }
-    level->resize_state = 1;
-    pflush((uint64_t *)&level->resize_state);
 
-    level->addr_capacity = pow(2, level->level_size + 1);
-    level->interim_level_buckets = pmalloc_lvl(level->addr_capacity*sizeof(level_bucket));
-    if (!level->interim_level_buckets) {
-        printf("The expanding fails: 2\n");
-        exit(1);
-    }
-    pflush((uint64_t *)&level->interim_level_buckets);
+    level_attach(level);
+    level->expand_thread_num = EXPAND_THREAD_NUM;
+    memset(&level->expand_stats, 0, sizeof(level_expand_stats));
+    level_recover(level);
+    level->auto_resize = 0;
+    level->grow_watermark = GROW_WATERMARK;
+    level->shrink_watermark = SHRINK_WATERMARK;
+    level->min_level_size = level->level_size;
+
+    printf("The number of top-level buckets: %ld\n", level->addr_capacity);
+    printf("The number of stored items: %ld\n", level->level_item_num[0] + level->level_item_num[1]);
+    printf("The level hash table opening succeeds!\n");
+    return level;
+}
 
-    uint64_t new_level_item_num = 0;
+/*
+Function: level_elapsed() 
+        Return the seconds elapsed since start
+*/
+static double level_elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+typedef struct expand_task {              // A range of bottom-level buckets rehashed by one thread during an expansion
+    level_hash *level;
+    uint8_t *bucket_locks;                // One lock per interim bucket when several threads rehash, NULL otherwise
+    uint64_t begin;
+    uint64_t end;
+    uint8_t resume;
+    uint64_t item_num;                    // The number of items the thread rehashed into the interim level
+} expand_task;
+
+/*
+Function: level_bucket_lock() 
+        Lock an interim bucket against the other rehashing threads
+*/
+static inline void level_bucket_lock(uint8_t *bucket_locks, uint64_t idx)
+{
+    if (!bucket_locks)
+        return;
+    while (__sync_lock_test_and_set(&bucket_locks[idx], 1))
+        while (*(volatile uint8_t *)&bucket_locks[idx])
+            ;
+}
+
+/*
+Function: level_bucket_unlock() 
+        Unlock an interim bucket
+*/
+static inline void level_bucket_unlock(uint8_t *bucket_locks, uint64_t idx)
+{
+    if (bucket_locks)
+        __sync_lock_release(&bucket_locks[idx]);
+}
+
+/*
+Function: level_expand_rehash_range()
+        Rehash the items in a range of bottom-level buckets into the interim level;
+        When resuming after a crash, some items of the range may already have been copied;
+        Both candidate buckets of an item are locked, the first one always first, since 
+        other threads may rehash items into them
+*/
+static void *level_expand_rehash_range(void *arg)
+{
+    expand_task *task = arg;
+    level_hash *level = task->level;
+    uint64_t new_capacity = pow(2, level->level_size + 1);
     uint64_t old_idx;
-    for (old_idx = 0; old_idx < pow(2, level->level_size - 1); old_idx ++) {
+    for (old_idx = task->begin; old_idx < task->end; old_idx ++) {
         uint64_t i, j;
         for(i = 0; i < ASSOC_NUM; i ++){
             if (GET_BIT(level->buckets[1][old_idx].token, i) != 0)
@@ -167,71 +334,255 @@ void level_expand(level_hash *level)
                 uint8_t *key = level->buckets[1][old_idx].slot[i].key;
                 uint8_t *value = level->buckets[1][old_idx].slot[i].value;
 
-                uint64_t f_idx = F_IDX(F_HASH(level, key), level->addr_capacity);
-                uint64_t s_idx = S_IDX(S_HASH(level, key), level->addr_capacity);
+                uint64_t f_hash, s_hash;
+                FS_HASH(level, key, &f_hash, &s_hash);
+                uint64_t f_idx = F_IDX(f_hash, new_capacity);
+                uint64_t s_idx = S_IDX(s_hash, new_capacity);
 
                 uint8_t insertSuccess = 0;
-                for(j = 0; j < ASSOC_NUM; j ++){        
-                    /*  The rehashed item is inserted into the less-loaded bucket between 
-                        the two hash locations in the new level
+                level_bucket_lock(task->bucket_locks, f_idx);
+                level_bucket_lock(task->bucket_locks, s_idx);
+                if (task->resume &&
+                    (level_find_slot(&level->interim_level_buckets[f_idx], key) != -1 ||
+                     level_find_slot(&level->interim_level_buckets[s_idx], key) != -1))
+                {
+                    insertSuccess = 1;
+                    task->item_num ++;
+                }
+                for(j = 0; j < ASSOC_NUM && !insertSuccess; j ++){        
+                    /*  The rehashed item is inserted into the first empty slot of the two hash 
+                        locations in the new level, checking the two buckets alternately slot by slot
                     */
                     if (GET_BIT(level->interim_level_buckets[f_idx].token, j) == 0)
                     {
                         memcpy(level->interim_level_buckets[f_idx].slot[j].key, key, KEY_LEN);
                         memcpy(level->interim_level_buckets[f_idx].slot[j].value, value, VALUE_LEN);
-                        asm_mfence();
-
                         level_slot_flush(&level->interim_level_buckets[f_idx], j);
 
-                        asm_mfence();
                         insertSuccess = 1;
-                        new_level_item_num ++;
+                        task->item_num ++;
                         break;
                     }
                     if (GET_BIT(level->interim_level_buckets[s_idx].token, j) == 0)
                     {
                         memcpy(level->interim_level_buckets[s_idx].slot[j].key, key, KEY_LEN);
                         memcpy(level->interim_level_buckets[s_idx].slot[j].value, value, VALUE_LEN);
-                        asm_mfence();
-                        
                         level_slot_flush(&level->interim_level_buckets[s_idx], j);
 
-                        asm_mfence();
                         insertSuccess = 1;
-                        new_level_item_num ++;
+                        task->item_num ++;
                         break;
                     }
                 }
+                level_bucket_unlock(task->bucket_locks, s_idx);
+                level_bucket_unlock(task->bucket_locks, f_idx);
 
                 if(!insertSuccess){
                     printf("The expanding fails: 3\n");
                     exit(1);                    
                 }
-                
-                SET_BIT(level->buckets[1][old_idx].token, i, 0);
-                pflush((uint64_t *)&level->buckets[1][old_idx].token);
-                asm_mfence();
             }
         }
     }
+
+    // A fence only orders the flushes of its own thread, so each thread drains its flushes before the progress moves past its range
+    pfence();
+    return NULL;
+}
+
+/*
+Function: level_expand_rehash()
+        Rehash the bottom-level items into the interim level, starting from the bucket 
+        recorded in resize_progress; the buckets are rehashed in rounds of EXPAND_CHUNK 
+        buckets per thread, and the progress is recorded after each round;
+        When resuming after a crash, the items of the interrupted round may already have been copied
+*/
+static void level_expand_rehash(level_hash *level, uint8_t resume)
+{
+    uint64_t old_num = pow(2, level->level_size - 1);
+    uint32_t thread_num = level->expand_thread_num;
+    if (thread_num < 1)
+        thread_num = 1;
+
+    uint8_t *bucket_locks = NULL;
+    if (thread_num > 1)
+    {
+        bucket_locks = calloc(pow(2, level->level_size + 1), sizeof(uint8_t));
+        if (!bucket_locks)
+        {
+            printf("The expanding fails: 4\n");
+            exit(1);
+        }
+    }
+
+    expand_task task[thread_num];
+    pthread_t thread[thread_num];
+    uint64_t new_level_item_num = level->interim_item_num;
+    uint64_t round_begin, round_end;
+    uint32_t t;
+    for (round_begin = level->resize_progress; round_begin < old_num; round_begin = round_end) {
+        round_end = round_begin + (uint64_t)thread_num*EXPAND_CHUNK;
+        if (round_end > old_num)
+            round_end = old_num;
+
+        for (t = 0; t < thread_num; t ++) {
+            task[t].level = level;
+            task[t].bucket_locks = bucket_locks;
+            task[t].begin = round_begin + (round_end - round_begin) * t / thread_num;
+            task[t].end = round_begin + (round_end - round_begin) * (t + 1) / thread_num;
+            task[t].resume = resume;
+            task[t].item_num = 0;
+        }
+        // The calling thread rehashes the first range itself
+        for (t = 1; t < thread_num; t ++) {
+            if (pthread_create(&thread[t], NULL, level_expand_rehash_range, &task[t]) != 0) {
+                printf("The expanding fails: 5\n");
+                exit(1);
+            }
+        }
+        level_expand_rehash_range(&task[0]);
+        for (t = 0; t < thread_num; t ++) {
+            if (t > 0)
+                pthread_join(thread[t], NULL);
+            new_level_item_num += task[t].item_num;
+        }
+
+        /*  The old bottom level is discarded as a whole, so the progress replaces clearing its tokens one by one;
+            every thread has made its rehashed items durable before the progress moves past the round
+        */
+        persist_plan plan = PPLAN_INIT;
+        level->interim_item_num = new_level_item_num;
+        level->resize_progress = round_end;
+        pplan_add(&plan, &level->resize_progress, sizeof(uint64_t));
+        pplan_add(&plan, &level->interim_item_num, sizeof(uint64_t));
+        pplan_flush(&plan);
+        pfence();
+    }
+
+    free(bucket_locks);
+}
+
+/*
+Function: level_expand_commit()
+        Atomically replace the old bottom level with the interim level on top
+*/
+static void level_expand_commit(level_hash *level)
+{
+    ptx_begin();
+    ptx_add(level, sizeof(level_hash));
+
     pfree(level->buckets[1], pow(2, level->level_size -1)*sizeof(level_bucket));
     level->level_size ++;
+    level->addr_capacity = pow(2, level->level_size);
     level->total_capacity = pow(2, level->level_size) + pow(2, level->level_size - 1);
 
-    level->buckets[1] = level->buckets[0];
-    level->buckets[0] = level->interim_level_buckets;
-    level->interim_level_buckets = NULL;
+    level->buckets_off[1] = level->buckets_off[0];
+    level->buckets_off[0] = level->interim_level_off;
+    level->interim_level_off = 0;
+    level_attach(level);
     
     level->level_item_num[1] = level->level_item_num[0];
-    level->level_item_num[0] = new_level_item_num;
+    level->level_item_num[0] = level->interim_item_num;
     level->level_expand_time ++;
+    level->resize_state = 0;
+
+    ptx_end();
+}
+
+/*
+Function: level_expand()
+        Expand a level hash table in place;
+        Put a new level on the top of the old hash table and only rehash the
+        items in the bottom level of the old hash table;
+        Return 1 without expanding the table if the pool has no room for it beyond max_level_size
+*/
+uint8_t level_expand(level_hash *level) 
+{
+    if (!level)
+    {
+        printf("The expanding fails: 1\n");
+        exit(1);
+    }
+
+    if (level->level_size >= level->max_level_size)
+        return 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The interim level is allocated and the resizing state is recorded in one transaction, so no crash can leak the interim level
+    ptx_begin();
+    ptx_add(level, sizeof(level_hash));
+    level->interim_level_off = poffset(pmalloc_lvl(pow(2, level->level_size + 1)*sizeof(level_bucket)));
+    if (!level->interim_level_off) {
+        printf("The expanding fails: 2\n");
+        exit(1);
+    }
+    level_attach(level);
+    level->resize_progress = 0;
+    level->interim_item_num = 0;
+    level->resize_state = 1;
+    ptx_end();
+    level->expand_stats.alloc_time = level_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    level_expand_rehash(level, 0);
+    level->expand_stats.rehash_time = level_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    level_expand_commit(level);
+    level->expand_stats.commit_time = level_elapsed(&start);
+    return 0;
+}
+
+static uint8_t level_insert_item(level_hash *level, uint8_t *key, uint8_t *value);
+
+/*
+Function: level_shrink_rehash()
+        Reinsert the items of the interim (old top) level into the shrunk hash table, starting
+        from the bucket recorded in resize_progress; when resuming after a crash, the item of 
+        the first bucket whose token was not yet cleared may already have been reinserted
+*/
+static void level_shrink_rehash(level_hash *level, uint8_t resume)
+{
+    uint64_t old_idx, i;
+    for (old_idx = level->resize_progress; old_idx < pow(2, level->level_size + 1); old_idx ++) {
+        for(i = 0; i < ASSOC_NUM; i ++){
+            if (GET_BIT(level->interim_level_buckets[old_idx].token, i) != 0)
+            {
+                uint8_t *key = level->interim_level_buckets[old_idx].slot[i].key;
+                if(!(resume && old_idx == level->resize_progress && level_static_query(level, key) != NULL) &&
+                    level_insert_item(level, key, level->interim_level_buckets[old_idx].slot[i].value)){
+                        printf("The shrinking fails: 3\n");
+                        exit(1);   
+                }
+
+                SET_BIT(level->interim_level_buckets[old_idx].token, i, 0);
+                pflush((uint64_t *)&level->interim_level_buckets[old_idx].token);
+            }
+        }
 
-    uint64_t *ptr = (uint64_t *)&level;
-    for(; ptr < (uint64_t *)&level + sizeof(level_hash); ptr += 8)
-        pflush((uint64_t *)&ptr);
+        level->resize_progress = old_idx + 1;
+        pflush((uint64_t *)&level->resize_progress);
+        pfence();
+    } 
+}
 
+/*
+Function: level_shrink_commit()
+        Atomically release the interim (old top) level and finish the shrinking
+*/
+static void level_shrink_commit(level_hash *level)
+{
+    ptx_begin();
+    ptx_add(level, sizeof(level_hash));
+
+    pfree(level->interim_level_buckets, pow(2, level->level_size + 1)*sizeof(level_bucket));
+    level->interim_level_off = 0;
+    level_attach(level);
     level->resize_state = 0;
-    pflush((uint64_t *)&level->resize_state);
+
+    ptx_end();
 }
 
 /*
@@ -254,15 +605,17 @@ void level_shrink(level_hash *level)
         exit(1);
     }
 
-    level->resize_state = 2;
-    pflush((uint64_t *)&level->resize_state);
+    // The new bottom level and the switch of the levels are committed in one transaction
+    ptx_begin();
+    ptx_add(level, sizeof(level_hash));
 
+    level->resize_state = 2;
     level->level_size --;
-    level_bucket *newBuckets = pmalloc_lvl(pow(2, level->level_size - 1)*sizeof(level_bucket));
-    level->interim_level_buckets = level->buckets[0];
-    level->buckets[0] = level->buckets[1];
-    level->buckets[1] = newBuckets;
-    newBuckets = NULL;
+    uint64_t newBuckets = poffset(pmalloc_lvl(pow(2, level->level_size - 1)*sizeof(level_bucket)));
+    level->interim_level_off = level->buckets_off[0];
+    level->buckets_off[0] = level->buckets_off[1];
+    level->buckets_off[1] = newBuckets;
+    level_attach(level);
 
     level->level_item_num[0] = level->level_item_num[1];
     level->level_item_num[1] = 0;
@@ -270,30 +623,12 @@ void level_shrink(level_hash *level)
     level->addr_capacity = pow(2, level->level_size);
     level->total_capacity = pow(2, level->level_size) + pow(2, level->level_size - 1);
     level->level_expand_time = 0;
+    level->resize_progress = 0;
 
-    uint64_t *ptr = (uint64_t *)&level;
-    for(; ptr < (uint64_t *)&level + sizeof(level_hash); ptr += 8)
-        pflush((uint64_t *)&ptr);
-
-    uint64_t old_idx, i;
-    for (old_idx = 0; old_idx < pow(2, level->level_size + 1); old_idx ++) {
-        for(i = 0; i < ASSOC_NUM; i ++){
-            if (GET_BIT(level->interim_level_buckets[old_idx].token, i) != 0)
-            {
-                if(level_insert(level, level->interim_level_buckets[old_idx].slot[i].key, level->interim_level_buckets[old_idx].slot[i].value)){
-                        printf("The shrinking fails: 3\n");
-                        exit(1);   
-                }
+    ptx_end();
 
-            SET_BIT(level->interim_level_buckets[old_idx].token, i, 0);
-            pflush((uint64_t *)&level->interim_level_buckets[old_idx].token);
-            }
-        }
-    } 
-
-    pfree(level->interim_level_buckets, pow(2, level->level_size + 1)*sizeof(level_bucket));
-    level->resize_state = 0;
-    pflush((uint64_t *)&level->resize_state);
+    level_shrink_rehash(level, 0);
+    level_shrink_commit(level);
 }
 
 /*
@@ -303,8 +638,8 @@ Function: level_dynamic_query()
 */
 uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
 {   
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
 
     uint64_t i, j, f_idx, s_idx;
     if(level->level_item_num[0] > level->level_item_num[1]){
@@ -313,13 +648,13 @@ uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
 
         for(i = 0; i < 2; i ++){
             for(j = 0; j < ASSOC_NUM; j ++){
-                if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
+                if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][f_idx].slot[j].key, key))
                 {
                     return level->buckets[i][f_idx].slot[j].value;
                 }
             }
             for(j = 0; j < ASSOC_NUM; j ++){
-                if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
+                if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][s_idx].slot[j].key, key))
                 {
                     return level->buckets[i][s_idx].slot[j].value;
                 }
@@ -334,13 +669,13 @@ uint8_t* level_dynamic_query(level_hash *level, uint8_t *key)
 
         for(i = 2; i > 0; i --){
             for(j = 0; j < ASSOC_NUM; j ++){
-                if (GET_BIT(level->buckets[i-1][f_idx].token, j) != 0&&strcmp(level->buckets[i-1][f_idx].slot[j].key, key) == 0)
+                if (GET_BIT(level->buckets[i-1][f_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i-1][f_idx].slot[j].key, key))
                 {
                     return level->buckets[i-1][f_idx].slot[j].value;
                 }
             }
             for(j = 0; j < ASSOC_NUM; j ++){
-                if (GET_BIT(level->buckets[i-1][s_idx].token, j) != 0&&strcmp(level->buckets[i-1][s_idx].slot[j].key, key) == 0)
+                if (GET_BIT(level->buckets[i-1][s_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i-1][s_idx].slot[j].key, key))
                 {
                     return level->buckets[i-1][s_idx].slot[j].value;
                 }
@@ -359,21 +694,21 @@ Function: level_static_query()
 */
 uint8_t* level_static_query(level_hash *level, uint8_t *key)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
     uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
     uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
     
     uint64_t i, j;
     for(i = 0; i < 2; i ++){
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][f_idx].slot[j].key, key))
             {
                 return level->buckets[i][f_idx].slot[j].value;
             }
         }
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][s_idx].slot[j].key, key))
             {
                 return level->buckets[i][s_idx].slot[j].value;
             }
@@ -386,6 +721,22 @@ uint8_t* level_static_query(level_hash *level, uint8_t *key)
 }
 
 
+/*
+Function: level_shrink_check()
+        With auto_resize, shrink the table after a deletion once the load factor falls under shrink_watermark;
+        The watermark is capped at a quarter of grow_watermark, so that the load factor after a shrinking, 
+        which doubles it, stays at half the grow watermark and the next insertions do not expand the table again
+*/
+static inline void level_shrink_check(level_hash *level)
+{
+    double watermark = level->shrink_watermark;
+    if (watermark > level->grow_watermark / 4)
+        watermark = level->grow_watermark / 4;
+    if (level->auto_resize && level->level_size > level->min_level_size &&
+        level->level_item_num[0] + level->level_item_num[1] < level->total_capacity*ASSOC_NUM*watermark)
+        level_shrink(level);
+}
+
 /*
 Function: level_delete() 
         Remove a key-value item from level hash table;
@@ -393,30 +744,34 @@ Function: level_delete()
 */
 uint8_t level_delete(level_hash *level, uint8_t *key)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
     uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
     uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
     
     uint64_t i, j;
     for(i = 0; i < 2; i ++){
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][f_idx].slot[j].key, key))
             {
                 SET_BIT(level->buckets[i][f_idx].token, j, 0);
                 pflush((uint64_t *)&level->buckets[i][f_idx].token);
                 level->level_item_num[i] --;
-                asm_mfence();
+                level_count_flush(level);
+                pfence();
+                level_shrink_check(level);
                 return 0;
             }
         }
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][s_idx].slot[j].key, key))
             {
                 SET_BIT(level->buckets[i][s_idx].token, j, 0);
                 pflush((uint64_t *)&level->buckets[i][s_idx].token);
                 level->level_item_num[i] --;
-                asm_mfence();
+                level_count_flush(level);
+                pfence();
+                level_shrink_check(level);
                 return 0;
             }
         }
@@ -434,84 +789,58 @@ Function: level_update()
 */
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
     uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
     uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
     
     uint64_t i, j, k;
     for(i = 0; i < 2; i ++){
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&strcmp(level->buckets[i][f_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][f_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][f_idx].slot[j].key, key))
             {
                 for(k = 0; k < ASSOC_NUM; k++){
                     if (GET_BIT(level->buckets[i][f_idx].token, k) == 0){        // Log-free update
                         memcpy(level->buckets[i][f_idx].slot[k].key, key, KEY_LEN);
                         memcpy(level->buckets[i][f_idx].slot[k].value, new_value, VALUE_LEN);
-                        asm_mfence();
-
-                        if(is_in_one_cache_line(&level->buckets[i][f_idx].slot[k], &level->buckets[i][f_idx].token))
-                        {
-                            level->buckets[i][f_idx].token |= (1<<k) & ~(1<<j);
-                            
-                            pflush((uint64_t *)&level->buckets[i][f_idx].slot[k].key);
-                            pflush((uint64_t *)&level->buckets[i][f_idx].slot[k].value);
-                        }
-                        else
-                        {   
-                            pflush((uint64_t *)&level->buckets[i][f_idx].slot[k].key);
-                            pflush((uint64_t *)&level->buckets[i][f_idx].slot[k].value);
-                            asm_mfence();
-                            level->buckets[i][f_idx].token |= (1<<k) & ~(1<<j);
-                        }
-
-                        pflush((uint64_t *)&level->buckets[i][f_idx].token);
-                        asm_mfence();
+                        // The new copy becomes visible and the old one invisible with a single token write
+                        level_slot_publish(&level->buckets[i][f_idx], k, (level->buckets[i][f_idx].token | (1<<k)) & ~(1<<j));
+                        pfence();
                         return 0;                        
                     }
                 }
                 log_write(level->log, key, new_value);
                 
                 memcpy(level->buckets[i][f_idx].slot[j].value, new_value, VALUE_LEN);
-                pflush((uint64_t *)&level->buckets[i][f_idx].slot[j].value);
+                persist_plan plan = PPLAN_INIT;
+                pplan_add(&plan, level->buckets[i][f_idx].slot[j].value, VALUE_LEN);
+                pplan_flush(&plan);
+                pfence();
                 
                 log_clean(level->log);
                 return 0;
             }
         }
         for(j = 0; j < ASSOC_NUM; j ++){
-            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&strcmp(level->buckets[i][s_idx].slot[j].key, key) == 0)
+            if (GET_BIT(level->buckets[i][s_idx].token, j) != 0&&KEY_EQUAL(level->buckets[i][s_idx].slot[j].key, key))
             {
                 for(k = 0; k < ASSOC_NUM; k++){
                     if (GET_BIT(level->buckets[i][s_idx].token, k) == 0){        // Log-free update
                         memcpy(level->buckets[i][s_idx].slot[k].key, key, KEY_LEN);
                         memcpy(level->buckets[i][s_idx].slot[k].value, new_value, VALUE_LEN);
-                        asm_mfence();
-                        
-                        if(is_in_one_cache_line(&level->buckets[i][s_idx].slot[k], &level->buckets[i][s_idx].token))
-                        {
-                            level->buckets[i][s_idx].token |= (1<<k) & ~(1<<j);
-                            
-                            pflush((uint64_t *)&level->buckets[i][s_idx].slot[k].key);
-                            pflush((uint64_t *)&level->buckets[i][s_idx].slot[k].value);
-                        }
-                        else
-                        {   
-                            pflush((uint64_t *)&level->buckets[i][s_idx].slot[k].key);
-                            pflush((uint64_t *)&level->buckets[i][s_idx].slot[k].value);
-                            asm_mfence();
-                            level->buckets[i][s_idx].token |= (1<<k) & ~(1<<j);
-                        }
-
-                        pflush((uint64_t *)&level->buckets[i][s_idx].token);
-                        asm_mfence();
+                        // The new copy becomes visible and the old one invisible with a single token write
+                        level_slot_publish(&level->buckets[i][s_idx], k, (level->buckets[i][s_idx].token | (1<<k)) & ~(1<<j));
+                        pfence();
                         return 0;                        
                     }
                 }
                 log_write(level->log, key, new_value);
                 
                 memcpy(level->buckets[i][s_idx].slot[j].value, new_value, VALUE_LEN);
-                pflush((uint64_t *)&level->buckets[i][s_idx].slot[j].value);
+                persist_plan plan = PPLAN_INIT;
+                pplan_add(&plan, level->buckets[i][s_idx].slot[j].value, VALUE_LEN);
+                pplan_flush(&plan);
+                pfence();
                 
                 log_clean(level->log);
                 return 0;
@@ -527,11 +856,31 @@ uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value)
 /*
 Function: level_insert() 
         Insert a key-value item into level hash table;
+        With auto_resize, the table is expanded once the load factor reaches grow_watermark,
+        and an insertion that fails expands the table and is retried;
+        The pool has no room to expand the table beyond max_level_size, so a full table then fails the insertion
 */
 uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
 {
-    uint64_t f_hash = F_HASH(level, key);
-    uint64_t s_hash = S_HASH(level, key);
+    if (level->auto_resize &&
+        level->level_item_num[0] + level->level_item_num[1] >= level->total_capacity*ASSOC_NUM*level->grow_watermark)
+        level_expand(level);
+
+    while (level_insert_item(level, key, value)) {
+        if (!level->auto_resize || level_expand(level))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+Function: level_insert_item() 
+        Insert a key-value item into level hash table without resizing it;
+*/
+static uint8_t level_insert_item(level_hash *level, uint8_t *key, uint8_t *value)
+{
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
     uint64_t f_idx = F_IDX(f_hash, level->addr_capacity);
     uint64_t s_idx = S_IDX(s_hash, level->addr_capacity);
 
@@ -540,31 +889,29 @@ uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
 
     for(i = 0; i < 2; i ++){
         for(j = 0; j < ASSOC_NUM; j ++){        
-            /*  The new item is inserted into the less-loaded bucket between 
-                the two hash locations in each level           
+            /*  The new item is inserted into the first empty slot of the two hash 
+                locations in each level, checking the two buckets alternately slot by slot
             */
             if (GET_BIT(level->buckets[i][f_idx].token, j) == 0)
             {
                 memcpy(level->buckets[i][f_idx].slot[j].key, key, KEY_LEN);
                 memcpy(level->buckets[i][f_idx].slot[j].value, value, VALUE_LEN);
-                asm_mfence();
-
                 level_slot_flush(&level->buckets[i][f_idx], j);
         
                 level->level_item_num[i] ++;
-                asm_mfence();
+                level_count_flush(level);
+                pfence();
                 return 0;
             }
             if (GET_BIT(level->buckets[i][s_idx].token, j) == 0) 
             {
                 memcpy(level->buckets[i][s_idx].slot[j].key, key, KEY_LEN);
                 memcpy(level->buckets[i][s_idx].slot[j].value, value, VALUE_LEN);
-                asm_mfence();
-
                 level_slot_flush(&level->buckets[i][s_idx], j);
 
                 level->level_item_num[i] ++;
-                asm_mfence();
+                level_count_flush(level);
+                pfence();
                 return 0;
             }
         }
@@ -593,12 +940,11 @@ uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
         if(empty_location != -1){
             memcpy(level->buckets[1][f_idx].slot[empty_location].key, key, KEY_LEN);
             memcpy(level->buckets[1][f_idx].slot[empty_location].value, value, VALUE_LEN);            
-            asm_mfence();
-            
             level_slot_flush(&level->buckets[1][f_idx], empty_location);
 
             level->level_item_num[1] ++;
-            asm_mfence();
+            level_count_flush(level);
+            pfence();
             return 0;
         }
 
@@ -606,12 +952,11 @@ uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value)
         if(empty_location != -1){
             memcpy(level->buckets[1][s_idx].slot[empty_location].key, key, KEY_LEN);
             memcpy(level->buckets[1][s_idx].slot[empty_location].value, value, VALUE_LEN);
-            asm_mfence();
-            
             level_slot_flush(&level->buckets[1][s_idx], empty_location);
 
             level->level_item_num[1] ++;
-            asm_mfence();
+            level_count_flush(level);
+            pfence();
             return 0;
         }
     }
@@ -629,8 +974,8 @@ uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_
     for(i = 0; i < ASSOC_NUM; i ++){
         uint8_t *m_key = level->buckets[level_num][idx].slot[i].key;
         uint8_t *m_value = level->buckets[level_num][idx].slot[i].value;
-        uint64_t f_hash = F_HASH(level, m_key);
-        uint64_t s_hash = S_HASH(level, m_key);
+        uint64_t f_hash, s_hash;
+        FS_HASH(level, m_key, &f_hash, &s_hash);
         uint64_t f_idx = F_IDX(f_hash, level->addr_capacity/(1+level_num));
         uint64_t s_idx = S_IDX(s_hash, level->addr_capacity/(1+level_num));
         
@@ -651,26 +996,23 @@ uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_
                 
                 memcpy(level->buckets[level_num][jdx].slot[j].key, m_key, KEY_LEN);
                 memcpy(level->buckets[level_num][jdx].slot[j].value, m_value, VALUE_LEN);
-                asm_mfence();
-                
                 level_slot_flush(&level->buckets[level_num][jdx], j);
 
-                asm_mfence();
+                pfence();
 
                 SET_BIT(level->buckets[level_num][idx].token, i, 0);
                 pflush((uint64_t *)&level->buckets[level_num][idx].token);
-                asm_mfence();
+                pfence();
                 // The movement is finished and then the new item is inserted
 
                 log_insert_clean(level->log);
                 memcpy(level->buckets[level_num][idx].slot[i].key, key, KEY_LEN);
                 memcpy(level->buckets[level_num][idx].slot[i].value, value, VALUE_LEN);
-                asm_mfence();
-
                 level_slot_flush(&level->buckets[level_num][idx], i);
 
                 level->level_item_num[level_num] ++;
-                asm_mfence();
+                level_count_flush(level);
+                pfence();
                 
                 return 0;
             }
@@ -694,8 +1036,7 @@ int b2t_movement(level_hash *level, uint64_t idx)
     for(i = 0; i < ASSOC_NUM; i ++){
         key = level->buckets[1][idx].slot[i].key;
         value = level->buckets[1][idx].slot[i].value;
-        f_hash = F_HASH(level, key);
-        s_hash = S_HASH(level, key);  
+        FS_HASH(level, key, &f_hash, &s_hash);
         f_idx = F_IDX(f_hash, level->addr_capacity);
         s_idx = S_IDX(s_hash, level->addr_capacity);
     
@@ -711,19 +1052,18 @@ int b2t_movement(level_hash *level, uint64_t idx)
 
                 memcpy(level->buckets[0][f_idx].slot[j].key, key, KEY_LEN);
                 memcpy(level->buckets[0][f_idx].slot[j].value, value, VALUE_LEN);
-                asm_mfence();
-                
                 level_slot_flush(&level->buckets[0][f_idx], j);
 
-                asm_mfence();
+                pfence();
 
                 SET_BIT(level->buckets[1][idx].token, i, 0);
                 pflush((uint64_t *)&level->buckets[1][idx].token);
-                asm_mfence();
+                pfence();
 
                 log_insert_clean(level->log);
                 level->level_item_num[0] ++;
                 level->level_item_num[1] --;
+                level_count_flush(level);          // The fence of the caller makes the counters durable
                 return i;
             }
             if (GET_BIT(level->buckets[0][s_idx].token, j) == 0)
@@ -737,19 +1077,18 @@ int b2t_movement(level_hash *level, uint64_t idx)
 
                 memcpy(level->buckets[0][s_idx].slot[j].key, key, KEY_LEN);
                 memcpy(level->buckets[0][s_idx].slot[j].value, value, VALUE_LEN);
-                asm_mfence();
-
                 level_slot_flush(&level->buckets[0][s_idx], j);
 
-                asm_mfence();
+                pfence();
 
                 SET_BIT(level->buckets[1][idx].token, i, 0);
                 pflush((uint64_t *)&level->buckets[1][idx].token);
-                asm_mfence();
+                pfence();
 
                 log_insert_clean(level->log);
                 level->level_item_num[0] ++;
                 level->level_item_num[1] --;
+                level_count_flush(level);          // The fence of the caller makes the counters durable
                 return i;
             }
         }
@@ -758,14 +1097,118 @@ int b2t_movement(level_hash *level, uint64_t idx)
     return -1;
 }
 
+/*
+Function: level_drop_duplicate() 
+        Invalidate every copy of the item in slot (level_num, idx, slot) other than that slot itself;
+        Such a copy is the source of a movement that was interrupted after its destination was written
+*/
+static void level_drop_duplicate(level_hash *level, uint64_t level_num, uint64_t idx, uint64_t slot)
+{
+    uint8_t *key = level->buckets[level_num][idx].slot[slot].key;
+    uint64_t f_hash, s_hash;
+    FS_HASH(level, key, &f_hash, &s_hash);
+    uint64_t cand[2];
+    uint64_t i, k;
+    int j;
+
+    for(i = 0; i < 2; i ++){
+        cand[0] = F_IDX(f_hash, level->addr_capacity/(1+i));
+        cand[1] = S_IDX(s_hash, level->addr_capacity/(1+i));
+        for(k = 0; k < 2; k ++){
+            level_bucket *bucket = &level->buckets[i][cand[k]];
+            for(j = 0; j < ASSOC_NUM; j ++){
+                if (i == level_num && cand[k] == idx && j == slot)
+                    continue;
+                if (GET_BIT(bucket->token, j) != 0&&KEY_EQUAL(bucket->slot[j].key, key))
+                {
+                    SET_BIT(bucket->token, j, 0);
+                    pflush((uint64_t *)&bucket->token);
+                    pfence();
+                    // A bottom-to-top movement also transfers the item between the level counters
+                    if (i != level_num)
+                    {
+                        level->level_item_num[i] --;
+                        level->level_item_num[level_num] ++;
+                        level_count_flush(level);
+                        pfence();
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Function: level_recover() 
+        Bring a level hash table back to a consistent state after a crash;
+        Complete the interrupted movements recorded in the insert log, redo the logged 
+        updates, and resume an interrupted resizing from the bucket it stopped at;
+        The cost is bounded by the log length and the unfinished resizing range
+*/
+void level_recover(level_hash *level)
+{
+    level_log *log = level->log;
+    uint64_t i;
+
+    for(i = 0; i < log->log_length; i ++){
+        log_entry_insert *entry = &log->entry_insert[i];
+        if(entry->flag == 0)
+            continue;
+
+        // If the copy reached its destination, the source is dropped; otherwise the movement never happened
+        if (GET_BIT(level->buckets[entry->level][entry->bucket].token, entry->slot) != 0)
+            level_drop_duplicate(level, entry->level, entry->bucket, entry->slot);
+
+        entry->flag = 0;
+        pflush((uint64_t *)entry);
+        pfence();
+    }
+
+    for(i = 0; i < log->log_length; i ++){
+        if(log->entry[i].flag == 0)
+            continue;
+
+        uint8_t *value = level_static_query(level, log->entry[i].key);
+        if(value != NULL){
+            persist_plan plan = PPLAN_INIT;
+            memcpy(value, log->entry[i].value, VALUE_LEN);
+            pplan_add(&plan, value, VALUE_LEN);
+            pplan_flush(&plan);
+            pfence();
+        }
+
+        log->entry[i].flag = 0;
+        pflush((uint64_t *)&log->entry[i].flag);
+        pfence();
+    }
+
+    if (level->resize_state == 1)
+    {
+        level_expand_rehash(level, 1);
+        level_expand_commit(level);
+    }
+    else if (level->resize_state == 2)
+    {
+        level_shrink_rehash(level, 1);
+        level_shrink_commit(level);
+    }
+}
+
 /*
 Function: level_destroy() 
         Destroy a level hash table
 */
 void level_destroy(level_hash *level)
 {
+    ptx_begin();
+    pset_root(NULL);
     pfree(level->buckets[0], pow(2, level->level_size)*sizeof(level_bucket));
     pfree(level->buckets[1], pow(2, level->level_size - 1)*sizeof(level_bucket));
+    pfree(level->interim_level_buckets, pow(2, level->level_size + 1)*sizeof(level_bucket));
+    pfree(level->log->entry, level->log->log_length*sizeof(log_entry));
+    pfree(level->log->entry_insert, level->log->log_length*sizeof(log_entry_insert));
     pfree(level->log, sizeof(level_log));
+    pfree(level, sizeof(level_hash));
+    ptx_end();
     level = NULL;
 }
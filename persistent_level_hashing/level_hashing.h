@@ -6,11 +6,32 @@
 #include <ctype.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "hash.h"
 #include "log.h"
 
 #define ASSOC_NUM 4                       // The number of slots in a bucket, should be smaller than 32
 
+#ifndef POOL_EXPAND_NUM
+#define POOL_EXPAND_NUM 4                 // The number of expansions the pool created by level_init() is sized for
+#endif
+
+#ifndef EXPAND_THREAD_NUM
+#define EXPAND_THREAD_NUM 1               // The default number of threads rehashing the bottom level during an expansion
+#endif
+
+#ifndef GROW_WATERMARK
+#define GROW_WATERMARK 0.85               // The default load factor at which an insertion first expands the table if auto_resize is set
+#endif
+
+#ifndef SHRINK_WATERMARK
+#define SHRINK_WATERMARK 0.1              // The default load factor under which a deletion shrinks the table if auto_resize is set
+#endif
+
+#ifndef EXPAND_CHUNK
+#define EXPAND_CHUNK 4096                 // The number of bottom-level buckets a thread rehashes between two progress records
+#endif
+
 // set the n-th bit to 0 or 1
 #define SET_BIT(token, n, bit) (bit ? (token|=(1<<n)) : (token&=~(1<<n)))
 
@@ -28,9 +49,16 @@ typedef struct level_bucket               // A bucket, put the tokens behind the
     uint32_t token;                       // each bit in the last ASSOC_NUM bits is used to indicate whether its corresponding slot is empty
 } level_bucket;                           // 128 byte; one bucket should be cache-line-aligned
 
-typedef struct level_hash {               // A Level hash table
-    level_bucket *buckets[2];             // The top level and bottom level in the Level hash table
-    level_bucket *interim_level_buckets;  // Used during resizing;
+typedef struct level_expand_stats {      // The time spent in each phase of the last expansion, in seconds
+    double alloc_time;                    // Allocating the interim level and recording the resizing state
+    double rehash_time;                   // Rehashing the bottom-level items into the interim level
+    double commit_time;                   // Freeing the old bottom level and installing the interim level
+} level_expand_stats;
+
+typedef struct level_hash {               // A Level hash table, whose persistent fields hold pool offsets instead of virtual addresses
+    uint64_t buckets_off[2];              // The pool offsets of the top level and bottom level in the Level hash table
+    uint64_t interim_level_off;           // The pool offset of the level used during resizing;
+    uint64_t log_off;                     // The pool offset of the log
     uint64_t level_item_num[2];           // The numbers of items stored in the top and bottom levels respectively
     uint64_t addr_capacity;               // The number of buckets in the top level
     uint64_t total_capacity;              // The number of all buckets in the Level hash table    
@@ -38,14 +66,28 @@ typedef struct level_hash {               // A Level hash table
     uint8_t level_expand_time;            // Indicate whether the Level hash table was expanded, ">1 or =1": Yes, "0": No;
     uint8_t resize_state;                 // Indicate the resizing state of the level hash table, ‘0’ means the hash table is not during resizing; 
                                           // ‘1’ means the hash table is being expanded; ‘2’ means the hash table is being shrunk.
+    uint64_t resize_progress;             // The index of the first bucket not yet rehashed by the ongoing resizing, used to resume it after a crash
+    uint64_t interim_item_num;            // The number of items rehashed into the interim level by the ongoing expanding
     uint64_t f_seed;
     uint64_t s_seed;                      // Two randomized seeds for hash functions
+    uint64_t max_level_size;              // The largest level_size the pool has room to expand the table to
 
+    // Volatile addresses derived from the pool offsets whenever the pool is mapped
+    level_bucket *buckets[2];             // The top level and bottom level in the Level hash table
+    level_bucket *interim_level_buckets;  // Used during resizing;
     level_log *log;                       // The log
+    uint32_t expand_thread_num;           // The number of threads rehashing the bottom level during an expansion
+    level_expand_stats expand_stats;      // The phase timing of the last expansion
+    uint8_t auto_resize;                  // "1": insertions expand and deletions shrink the table by the watermarks below, "0": the caller resizes it
+    double grow_watermark;                // The load factor at which an insertion expands the table first
+    double shrink_watermark;              // The load factor under which a deletion shrinks the table
+    uint64_t min_level_size;              // The table is never shrunk below the level_size it had when created or opened
 } level_hash;
 
 level_hash *level_init(const char*, uint64_t level_size);     
 
+level_hash *level_open(const char*);
+
 uint8_t level_insert(level_hash *level, uint8_t *key, uint8_t *value);          
 
 uint8_t* level_static_query(level_hash *level, uint8_t *key);
@@ -56,7 +98,7 @@ uint8_t level_delete(level_hash *level, uint8_t*key);
 
 uint8_t level_update(level_hash *level, uint8_t *key, uint8_t *new_value);
 
-void level_expand(level_hash *level);
+uint8_t level_expand(level_hash *level);
 
 void level_shrink(level_hash *level);
 
@@ -64,4 +106,6 @@ uint8_t try_movement(level_hash *level, uint64_t idx, uint64_t level_num, uint8_
 
 int b2t_movement(level_hash *level, uint64_t idx);
 
+void level_recover(level_hash *level);
+
 void level_destroy(level_hash *level);
\ No newline at end of file
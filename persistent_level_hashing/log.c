@@ -21,6 +21,7 @@ level_log* log_create(uint64_t log_length)
     }
 
     log->log_length = log_length;
+    log->entry_off = poffset(log->entry);
     log->current = 0;
 
     log->entry_insert = pmalloc_lvl(log_length*sizeof(log_entry_insert));
@@ -30,26 +31,50 @@ level_log* log_create(uint64_t log_length)
         exit(1);
     }
 
+    log->entry_insert_off = poffset(log->entry_insert);
     log->current_insert= 0;
+
+    persist_plan plan = PPLAN_INIT;
+    pplan_add(&plan, log, sizeof(level_log));
+    pplan_flush(&plan);
+    pfence();
     
     return log;
 }
 
+/*
+Function: log_attach() 
+        Derive the addresses of the log entries from their pool offsets after the pool is mapped;
+*/
+void log_attach(level_log *log)
+{
+    log->entry = pdirect(log->entry_off);
+    log->entry_insert = pdirect(log->entry_insert_off);
+}
+
 /*
 Function: log_write() 
         Write a log entry;
+        A log entry is 32 bytes and the entries are cache-line aligned, so the flag is normally in 
+        the same cache line as the key-value item and is ordered after it by program order alone
 */
 void log_write(level_log *log, uint8_t *key, uint8_t *value)
 {
-    memcpy(log->entry[log->current].key, key, KEY_LEN);
-    memcpy(log->entry[log->current].value, value, VALUE_LEN);
-    pflush((uint64_t *)&log->entry[log->current].key);
-    pflush((uint64_t *)&log->entry[log->current].value);
-    asm_mfence();
+    log_entry *entry = &log->entry[log->current];
+    persist_plan plan = PPLAN_INIT;
+
+    memcpy(entry->key, key, KEY_LEN);
+    memcpy(entry->value, value, VALUE_LEN);
+    pplan_add(&plan, entry, sizeof(log_entry));
+    if (((uint64_t)entry ^ ((uint64_t)entry + sizeof(log_entry) - 1)) >= CACHE_LINE_SIZE) {
+        pplan_flush(&plan);
+        pfence();
+    }
     
-    log->entry[log->current].flag = 1;
-    pflush((uint64_t *)&log->entry[log->current].flag);
-    asm_mfence();
+    entry->flag = 1;
+    pplan_add(&plan, &entry->flag, sizeof(entry->flag));
+    pplan_flush(&plan);
+    pfence();
 }
 
 /*
@@ -58,15 +83,17 @@ Function: log_clean()
 */
 void log_clean(level_log *log)
 {
+    persist_plan plan = PPLAN_INIT;
+
     log->entry[log->current].flag = 0;
-    pflush((uint64_t *)&log->entry[log->current].flag);
-    asm_mfence();
+    pplan_add(&plan, &log->entry[log->current].flag, sizeof(uint8_t));
 
     log->current ++;
     if(log->current == log->log_length)
         log->current = 0;
-    pflush((uint64_t *)&log->current);
-    asm_mfence();
+    pplan_add(&plan, &log->current, sizeof(uint64_t));
+    pplan_flush(&plan);
+    pfence();
 }
 
 /*
@@ -77,22 +104,25 @@ void log_insert_write(level_log * log,log_entry_insert entry)
 {
     log->entry_insert[log->current_insert] = entry;
     pflush((uint64_t *)&log->entry_insert[log->current_insert]);
-    asm_mfence();
+    pfence();
 }
 
 /*
 Function: log_insert_sclean() 
         Clean up an entry in the insert log;
+        No fence is issued: a live entry whose movement has completed is harmless to 
+        recovery, and the next fence of the insertion orders the flushes anyway
 */
 void log_insert_clean(level_log *log)
 {
+    persist_plan plan = PPLAN_INIT;
+
     log->entry_insert[log->current_insert].flag = 0;
-    pflush((uint64_t *)&log->entry_insert[log->current_insert]);
-    asm_mfence();
+    pplan_add(&plan, &log->entry_insert[log->current_insert], sizeof(log_entry_insert));
 
     log->current_insert++;
     if(log->current_insert== log->log_length)
         log->current_insert= 0;
-    pflush((uint64_t *)&log->current_insert);
-    asm_mfence();
+    pplan_add(&plan, &log->current_insert, sizeof(uint64_t));
+    pplan_flush(&plan);
 }
@@ -7,7 +7,14 @@
 #include <math.h>
 #include "pflush.h"
 
+// Keys are NUL-terminated strings of at most KEY_LEN bytes by default;
+// define BINARY_KEY for binary keys of exactly KEY_LEN bytes, or INTEGER_KEY for 8-byte integer keys
+#ifdef INTEGER_KEY
+#define KEY_LEN 8                         // An integer key is a uint64_t in native byte order
+#else
 #define KEY_LEN 16                        // The maximum length of a key
+#endif
+
 #define VALUE_LEN 15                      // The maximum length of a value
 
 typedef struct log_entry{                
@@ -27,15 +34,20 @@ typedef struct log_entry_insert{
 typedef struct level_log
 { 
     uint64_t log_length;
-    log_entry* entry;
+    uint64_t entry_off;                   // Pool offset of the log entries
     uint64_t current;
 
-    log_entry_insert* entry_insert;
+    uint64_t entry_insert_off;            // Pool offset of the insert log entries
     uint64_t current_insert;
+
+    log_entry* entry;                     // Volatile addresses derived from the offsets by log_attach()
+    log_entry_insert* entry_insert;
 }level_log;
 
 level_log* log_create(uint64_t log_length);
 
+void log_attach(level_log *log);
+
 void log_write(level_log *log, uint8_t *key, uint8_t *value);
 
 void log_clean(level_log *log);
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "pflush.h"
 #include "libpmem.h"
@@ -15,6 +16,56 @@ void pflush(uint64_t *addr)
     // iangneal: just use PMDK.
     // Should flush just one line, regardless of offset.
     pmem_flush(addr, 1);
+    pstats.flush_num ++;
+}
+
+persist_stats pstats;
+
+/*
+Function: pfence() 
+        Order the preceding flushes before the following stores
+*/
+void pfence(void)
+{
+    pmem_drain();
+    pstats.fence_num ++;
+}
+
+/*
+Function: pplan_add() 
+        Record the cache lines covering nbytes at addr in a persist plan; 
+        a line already in the plan is not recorded twice
+*/
+void pplan_add(persist_plan *plan, void *addr, size_t nbytes)
+{
+    uint64_t line = (uint64_t)addr & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+    uint64_t last = ((uint64_t)addr + nbytes - 1) & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+    uint32_t i;
+
+    for (; line <= last; line += CACHE_LINE_SIZE) {
+        for (i = 0; i < plan->line_num; i ++) {
+            if (plan->line[i] == line)
+                break;
+        }
+        if (i < plan->line_num)
+            continue;
+        if (plan->line_num == PPLAN_MAX_LINES)
+            pplan_flush(plan);
+        plan->line[plan->line_num ++] = line;
+    }
+}
+
+/*
+Function: pplan_flush() 
+        Flush every cache line recorded in a persist plan and empty the plan
+*/
+void pplan_flush(persist_plan *plan)
+{
+    uint32_t i;
+    for (i = 0; i < plan->line_num; i ++)
+        pmem_flush((void *)plan->line[i], CACHE_LINE_SIZE);
+    pstats.flush_num += plan->line_num;
+    plan->line_num = 0;
 }
 
 static PMEMobjpool *pop;
@@ -23,69 +74,193 @@ static PMEMobjpool *pop;
 #define TYPE_OFFSET 1012
 #endif
 
-TOID_DECLARE(struct alloc_node, TYPE_OFFSET + 0);
 TOID_DECLARE(struct driver_root, TYPE_OFFSET + 1);
 TOID_DECLARE(char, TYPE_OFFSET + 2);
 
-typedef struct alloc_node {
-    TOID(struct alloc_node) next;
-    TOID(char) data;
-} alloc_node_t;
-
 typedef struct driver_root {
-    TOID(struct alloc_node) head;
-    TOID(struct alloc_node) tail;
+    PMEMoid table;                        // The level hash table stored in this pool
 } driver_root_t;
 
 POBJ_LAYOUT_BEGIN(driver);
 POBJ_LAYOUT_ROOT(driver, driver_root_t);
 POBJ_LAYOUT_END(driver);
 
-void init_pmalloc(const char *fname)
+/*  Every block handed out by pmalloc_lvl() starts on a cache line. The allocation is
+    over-sized by one cache line and the offset of the underlying PMDK object is kept in 
+    the 8 bytes right before the returned address, where pfree() finds it again.
+*/
+#define PMALLOC_ALIGN 64
+
+/*
+Function: init_pmalloc() 
+        Create a pool of pool_size bytes (at least PMEMOBJ_MIN_POOL), or open the pool if it exists;
+        Return the size of the pool, which is the size of the file for an existing pool
+*/
+size_t init_pmalloc(const char *fname, size_t pool_size)
 {
-    pop = pmemobj_create(fname, POBJ_LAYOUT_NAME(driver), PMEMOBJ_MIN_POOL, 0666);
+    if (pool_size < PMEMOBJ_MIN_POOL)
+        pool_size = PMEMOBJ_MIN_POOL;
+
+    pop = pmemobj_create(fname, POBJ_LAYOUT_NAME(driver), pool_size, 0666);
     if (pop == NULL) {
 	    pop = pmemobj_open(fname, POBJ_LAYOUT_NAME(driver));
+        struct stat st;
+        if (pop && stat(fname, &st) == 0)
+            pool_size = st.st_size;
     }
 
     assert(pop && "Cannot be null!");
+    return pool_size;
 }
 
-void *pmalloc_lvl(size_t nbytes) {
+/*
+Function: open_pmalloc() 
+        Map an existing pool; return 1 if the pool cannot be opened
+*/
+int open_pmalloc(const char *fname)
+{
+    pop = pmemobj_open(fname, POBJ_LAYOUT_NAME(driver));
+    return pop == NULL;
+}
+
+/*
+Function: close_pmalloc() 
+        Unmap the pool, so that init_pmalloc() or open_pmalloc() can map it again
+*/
+void close_pmalloc()
+{
+    if (pop)
+        pmemobj_close(pop);
+    pop = NULL;
+}
+
+/*
+Function: poffset() 
+        Translate an address in the pool into its pool-relative offset, which stays 
+        valid wherever the pool is mapped; NULL is translated into 0
+*/
+uint64_t poffset(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    return (uint64_t)((char *)ptr - (char *)pop);
+}
+
+/*
+Function: pdirect() 
+        Translate a pool-relative offset into an address in the current mapping
+*/
+void *pdirect(uint64_t off)
+{
+    if (off == 0)
+        return NULL;
+    return (char *)pop + off;
+}
+
+/*
+Function: pset_root() 
+        Anchor an object at the root of the pool so that it can be found after a restart
+*/
+void pset_root(void *ptr)
+{
     TOID(struct driver_root) root = POBJ_ROOT(pop, struct driver_root);
 
     TX_BEGIN(pop) {
         TX_ADD(root);
+        D_RW(root)->table = pmemobj_oid(ptr);
+    } TX_END
+}
 
-        TOID(struct alloc_node) new_node = TX_ZNEW(struct alloc_node);
+/*
+Function: pget_root() 
+        Return the object anchored at the root of the pool, or NULL if there is none
+*/
+void *pget_root(void)
+{
+    TOID(struct driver_root) root = POBJ_ROOT(pop, struct driver_root);
+    return pmemobj_direct(D_RO(root)->table);
+}
 
-        D_RW(new_node)->data = TX_ALLOC(char, nbytes);
+/*
+Function: pmalloc_lvl() 
+        Allocate nbytes of zeroed, cache-line-aligned persistent memory;
+        Inside a transaction the allocation is undone if the transaction does not commit
+*/
+void *pmalloc_lvl(size_t nbytes)
+{
+    PMEMoid oid = OID_NULL;
 
-        if (!TOID_IS_NULL(D_RO(root)->tail)) {
-            // Set tail next
-            TOID(struct alloc_node) old_tail = D_RO(root)->tail;
-            assert(TOID_IS_NULL(D_RO(old_tail)->next));
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        oid = pmemobj_tx_zalloc(nbytes + PMALLOC_ALIGN, TOID_TYPE_NUM(char));
+    } else if (pmemobj_zalloc(pop, &oid, nbytes + PMALLOC_ALIGN, TOID_TYPE_NUM(char)) != 0) {
+        oid = OID_NULL;
+    }
+    if (OID_IS_NULL(oid))
+        return NULL;
 
-            TX_ADD(old_tail);
+    uint64_t base = (uint64_t)pmemobj_direct(oid);
+    uint64_t *alloc_addr = (uint64_t *)((base + sizeof(uint64_t) + PMALLOC_ALIGN - 1) & ~(uint64_t)(PMALLOC_ALIGN - 1));
+    alloc_addr[-1] = oid.off;
+    pmem_persist(&alloc_addr[-1], sizeof(uint64_t));
 
-            D_RW(old_tail)->next = new_node;
+    return alloc_addr;
+}
 
-        }
+/*
+Function: pfree() 
+        Return a block allocated by pmalloc_lvl() to the pool so that it can be reused;
+        Inside a transaction the block is released only if the transaction commits
+*/
+void pfree(void *ptr, size_t nelem)
+{
+    if (ptr == NULL)
+        return;
 
-        D_RW(root)->tail = new_node;
+    PMEMoid oid = pmemobj_oid(ptr);
+    oid.off = ((uint64_t *)ptr)[-1];
 
-        if (TOID_IS_NULL(D_RO(root)->head)) {
-            D_RW(root)->head = new_node;
-        }
-    } TX_END
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        pmemobj_tx_free(oid);
+    } else {
+        pmemobj_free(&oid);
+    }
+}
 
-    void *alloc_addr = (void*)pmemobj_direct(D_RO(D_RO(root)->tail)->data.oid);
-    printf("\talloc-ed %p, len %lx\n", alloc_addr, nbytes);
+/*
+Function: ptx_begin() 
+        Begin a failure-atomic transaction; allocations made by pmalloc_lvl() and the
+        ranges registered by ptx_add() take effect together or not at all
+*/
+void ptx_begin(void)
+{
+    if (pmemobj_tx_begin(pop, NULL, TX_PARAM_NONE) != 0) {
+        printf("The transaction fails: 1\n");
+        exit(1);
+    }
+}
 
-    return alloc_addr;
+/*
+Function: ptx_add() 
+        Snapshot a range of persistent memory before modifying it in the current transaction
+*/
+void ptx_add(void *ptr, size_t nbytes)
+{
+    if (pmemobj_tx_add_range_direct(ptr, nbytes) != 0) {
+        printf("The transaction fails: 2\n");
+        exit(1);
+    }
 }
 
-void pfree(void *ptr, size_t nelem) {
-    // Do nothing!
-    fprintf(stderr, "\t\t%s remains unimplemented!\n", __FUNCTION__);
+/*
+Function: ptx_end() 
+        Commit the current transaction
+*/
+void ptx_end(void)
+{
+    if (pmemobj_tx_stage() == TX_STAGE_WORK)
+        pmemobj_tx_commit();
+    if (pmemobj_tx_end() != 0) {
+        printf("The transaction fails: 3\n");
+        exit(1);
+    }
 }
@@ -19,11 +19,56 @@
     __asm__ __volatile__ ("mfence":::"memory");    \
 })
 
+#define CACHE_LINE_SIZE 64
+#define PPLAN_MAX_LINES 8                 // The number of distinct cache lines a persist plan collects before it flushes them
+
+/*  Persist plan: 
+    Collect the cache lines dirtied by an operation and flush each distinct line once.
+    Flushes go through PMDK, which uses clwb or clflushopt when the CPU supports them,
+    and pfence() then only needs to issue an sfence.
+*/
+typedef struct persist_plan {
+    uint64_t line[PPLAN_MAX_LINES];
+    uint32_t line_num;
+} persist_plan;
+
+#define PPLAN_INIT { .line_num = 0 }
+
+typedef struct persist_stats {            // The persistence instructions issued since the program started, not synchronized across threads
+    uint64_t flush_num;                   // The number of flushed cache lines
+    uint64_t fence_num;                   // The number of ordering fences
+} persist_stats;
+
+extern persist_stats pstats;
 
 void pflush(uint64_t *addr);
 
-void init_pmalloc(const char *fname);
+void pfence(void);
+
+void pplan_add(persist_plan *plan, void *addr, size_t nbytes);
+
+void pplan_flush(persist_plan *plan);
+
+size_t init_pmalloc(const char *fname, size_t pool_size);
+
+int open_pmalloc(const char *fname);
+
+void close_pmalloc();
+
+uint64_t poffset(void *ptr);
+
+void *pdirect(uint64_t off);
+
+void pset_root(void *ptr);
+
+void *pget_root(void);
 
 void *pmalloc_lvl(size_t nbytes);
 
 void pfree(void *ptr, size_t nelem);
+
+void ptx_begin(void);
+
+void ptx_add(void *ptr, size_t nbytes);
+
+void ptx_end(void);
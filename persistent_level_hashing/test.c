@@ -1,5 +1,14 @@
 #include "level_hashing.h"
 
+/*  Print the average number of flushed cache lines and fences of the operations in a phase
+*/
+static void print_persist_stats(const char *phase, persist_stats *start, uint64_t op_num)
+{
+    printf("%s: %.2f flushes and %.2f fences per operation\n", phase,
+        (double)(pstats.flush_num - start->flush_num)/op_num, (double)(pstats.fence_num - start->fence_num)/op_num);
+    *start = pstats;
+}
+
 /*  Test:
     This is a simple test example to test the creation, insertion, search, deletion, update in Level hashing
 */
@@ -8,34 +17,46 @@ int main(int argc, char* argv[])
     const char* fname = argv[1];                  // INPUT: pmem file name
     int level_size = atoi(argv[2]);                     // INPUT: the number of addressable buckets is 2^level_size
     int insert_num = atoi(argv[3]);                     // INPUT: the number of items to be inserted
+    int expand_thread_num = argc > 4 ? atoi(argv[4]) : EXPAND_THREAD_NUM;   // INPUT (optional): the number of threads rehashing during an expansion
 
-    level_hash *level = level_init(fname, level_size);
-    uint64_t inserted = 0, i = 0;
+    level_hash *level = level_open(fname);              // Reuse the table left in the pool by an interrupted run, if any
+    uint8_t reopened = level != NULL;
+    if (!level)
+        level = level_init(fname, level_size);
+    level->expand_thread_num = expand_thread_num;
+    level->auto_resize = 1;                             // Insertions expand the table and deletions shrink it
+    uint64_t inserted = 0, i = 0, level_size_before;
     uint8_t key[KEY_LEN];
     uint8_t value[VALUE_LEN];
+    persist_stats start = pstats;
 
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         snprintf(value, VALUE_LEN, "%ld", i);
-        if (!level_insert(level, key, value))                               
-        {
+        level_size_before = level->level_size;
+        // The table has no duplicate check, so the keys a reopened table already holds are not inserted again
+        if (reopened && level_static_query(level, key) != NULL)
             inserted ++;
-        }else
-        {
-            printf("Expanding: space utilization & total entries: %f  %ld\n", \
-                (float)(level->level_item_num[0]+level->level_item_num[1])/(level->total_capacity*ASSOC_NUM), \
-                level->total_capacity*ASSOC_NUM);
-            level_expand(level);
-            level_insert(level, key, value);
+        else if (!level_insert(level, key, value))                               
             inserted ++;
+        else
+            printf("Insert the key %s: ERROR! \n", key);
+        if (level->level_size != level_size_before)
+        {
+            printf("Expanded to %ld total entries with %d threads: allocation %fs, rehashing %fs, commit %fs\n", \
+                level->total_capacity*ASSOC_NUM, expand_thread_num, \
+                level->expand_stats.alloc_time, level->expand_stats.rehash_time, level->expand_stats.commit_time);
         }
     }   
     printf("%ld items are inserted\n", inserted);
+    print_persist_stats("Insertion", &start, insert_num);
 
     printf("The static search test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         uint8_t* get_value = level_static_query(level, key);
         if(get_value == NULL)
@@ -45,6 +66,7 @@ int main(int argc, char* argv[])
     printf("The dynamic search test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         uint8_t* get_value = level_dynamic_query(level, key);
         if(get_value == NULL)
@@ -54,19 +76,23 @@ int main(int argc, char* argv[])
     printf("The update test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         snprintf(value, VALUE_LEN, "%ld", i*2);
         if(level_update(level, key, value))
             printf("Update the value of the key %s: ERROR! \n", key);
    }
+    print_persist_stats("Update", &start, insert_num);
 
     printf("The deletion test begins ...\n");
     for (i = 1; i < insert_num + 1; i ++)
     {
+        memset(key, 0, KEY_LEN);
         snprintf(key, KEY_LEN, "%ld", i);
         if(level_delete(level, key))
             printf("Delete the key %s: ERROR! \n", key);
    }
+    print_persist_stats("Deletion", &start, insert_num);
 
     printf("The number of items stored in the level hash table: %ld\n", level->level_item_num[0]+level->level_item_num[1]);    
     level_destroy(level);
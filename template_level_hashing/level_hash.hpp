@@ -0,0 +1,664 @@
+#ifndef LEVEL_HASH_HPP
+#define LEVEL_HASH_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*  A header-only Level hash table whose bucket geometry, locking and flushing are chosen at compile time:
+        LevelHash<Key, Value, Assoc, ConcurrencyPolicy, PersistencePolicy, Hash>
+    The probe loops over the Assoc slots of a bucket are unrolled for the given associativity, and the lock and
+    flush hooks of the default policies are empty inline functions that compile to nothing.
+*/
+namespace level {
+
+/*  A concurrency policy has a table-wide lock, taken shared by queries and exclusively by resizing, and hooks
+    locking single buckets, whose state lock_word is a base of every bucket so that an empty one takes no space;
+    modifications take the table-wide lock shared and lock their buckets if parallel_modify is true, and take
+    it exclusively otherwise
+*/
+
+/*
+Policy: no_lock
+        The single-threaded table of level_hashing/; every hook is empty
+*/
+struct no_lock {
+    struct lock_word {};
+    static constexpr bool parallel_modify = false;
+    void read_lock() {}
+    void read_unlock() {}
+    void write_lock() {}
+    void write_unlock() {}
+    static void lock(lock_word &) {}
+    static bool try_lock(lock_word &) { return true; }
+    static void unlock(lock_word &) {}
+};
+
+/*
+Policy: shared_lock
+        Queries run in parallel and modifications and resizing are serialized by a reader-writer lock
+*/
+struct shared_lock {
+    struct lock_word {};
+    static constexpr bool parallel_modify = false;
+    std::shared_mutex mutex;
+    void read_lock() { mutex.lock_shared(); }
+    void read_unlock() { mutex.unlock_shared(); }
+    void write_lock() { mutex.lock(); }
+    void write_unlock() { mutex.unlock(); }
+    static void lock(lock_word &) {}
+    static bool try_lock(lock_word &) { return true; }
+    static void unlock(lock_word &) {}
+};
+
+/*
+Policy: bucket_lock
+        Queries and modifications of different buckets run in parallel: an operation spin-locks the four
+        candidate buckets of its key in address order, a movement only try-locks the bucket it moves an item to
+        and is skipped if that fails, and resizing alone takes the reader-writer lock exclusively
+*/
+struct bucket_lock {
+    struct lock_word {
+        std::atomic<uint8_t> locked;
+    };
+    static constexpr bool parallel_modify = true;
+    std::shared_mutex mutex;
+    void read_lock() { mutex.lock_shared(); }
+    void read_unlock() { mutex.unlock_shared(); }
+    void write_lock() { mutex.lock(); }
+    void write_unlock() { mutex.unlock(); }
+    static void lock(lock_word &w) {
+        while (w.locked.exchange(1, std::memory_order_acquire)) {
+            while (w.locked.load(std::memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+#endif
+            }
+        }
+    }
+    static bool try_lock(lock_word &w) {
+        return !w.locked.load(std::memory_order_relaxed) && !w.locked.exchange(1, std::memory_order_acquire);
+    }
+    static void unlock(lock_word &w) { w.locked.store(0, std::memory_order_release); }
+};
+
+/*  A persistence policy flushes and orders the writes to the levels, and allocates the levels: allocate()
+    returns size bytes aligned to a cache line, or nullptr, and deallocate() frees them, so that a policy
+    can place the levels in a persistent memory pool instead of DRAM
+*/
+
+/*
+Policy: no_flush
+        The DRAM table; nothing is flushed
+*/
+struct no_flush {
+    static void persist(const void *, size_t) {}
+    static void fence() {}
+    static void *allocate(size_t size) { return ::operator new(size, std::align_val_t(64), std::nothrow); }
+    static void deallocate(void *addr, size_t) { ::operator delete(addr, std::align_val_t(64)); }
+};
+
+/*
+Policy: clflush_flush
+        Flush every written cache line and order the flushes with a fence, as pflush() does in
+        persistent_level_hashing/, so that an item is durable before the token publishing it
+*/
+struct clflush_flush {
+    static void persist(const void *addr, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+        uintptr_t line = reinterpret_cast<uintptr_t>(addr) & ~uintptr_t(63);
+        for (; line < reinterpret_cast<uintptr_t>(addr) + len; line += 64)
+            _mm_clflush(reinterpret_cast<const void *>(line));
+#else
+        (void)addr; (void)len;
+#endif
+    }
+    static void fence() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_sfence();
+#else
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+    }
+    // The levels are in DRAM, so the flushes only show their cost; a policy for persistent memory allocates them from its pool
+    static void *allocate(size_t size) { return ::operator new(size, std::align_val_t(64), std::nothrow); }
+    static void deallocate(void *addr, size_t) { ::operator delete(addr, std::align_val_t(64)); }
+};
+
+namespace detail {
+
+// Call f(0), f(1), ..., f(N-1) with compile-time indices until one returns true; return whether any did
+template <class F, size_t... I>
+inline bool unroll(F &&f, std::index_sequence<I...>) {
+    return (f(std::integral_constant<size_t, I>{}) || ...);
+}
+
+template <size_t N, class F>
+inline bool unroll(F &&f) {
+    return unroll(std::forward<F>(f), std::make_index_sequence<N>{});
+}
+
+// The smallest unsigned integer holding one token bit per slot
+template <size_t Assoc>
+using token_t = std::conditional_t<(Assoc <= 8), uint8_t,
+                std::conditional_t<(Assoc <= 16), uint16_t,
+                std::conditional_t<(Assoc <= 32), uint32_t, uint64_t>>>;
+
+// The finalizer of MurmurHash3, also used by hash_mix() in hash.c
+inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+template <class L>
+struct read_guard {
+    L &lock;
+    explicit read_guard(L &l) : lock(l) { lock.read_lock(); }
+    ~read_guard() { lock.read_unlock(); }
+};
+
+template <class L>
+struct write_guard {
+    L &lock;
+    explicit write_guard(L &l) : lock(l) { lock.write_lock(); }
+    ~write_guard() { lock.write_unlock(); }
+};
+
+} // namespace detail
+
+template <class Key, class Value, size_t Assoc = 4,
+          class ConcurrencyPolicy = no_lock, class PersistencePolicy = no_flush,
+          class Hash = std::hash<Key>>
+class LevelHash {
+    static_assert(Assoc >= 1 && Assoc <= 64, "A bucket holds 1 to 64 slots");
+
+public:
+    using token_type = detail::token_t<Assoc>;
+    static constexpr size_t assoc = Assoc;          // The number of slots in a bucket
+
+    struct entry {                                  // A slot storing a key-value item
+        Key key;
+        Value value;
+    };
+
+    // A bucket; bit j of the token is set if slot j holds an item
+    struct bucket : ConcurrencyPolicy::lock_word {
+        token_type token;
+        entry slot[Assoc];
+    };
+
+    /*
+    Function: LevelHash()
+            Create a Level hash table with 2^level_size buckets in the top level
+    */
+    explicit LevelHash(uint64_t level_size, const Hash &hash = Hash())
+        : hash_(hash), level_size_(level_size < 1 ? 1 : level_size) {
+        std::random_device rd;
+        f_seed_ = (uint64_t(rd()) << 32) | rd();
+        do {
+            s_seed_ = (uint64_t(rd()) << 32) | rd();
+        } while (s_seed_ == f_seed_);
+
+        addr_capacity_ = uint64_t(1) << level_size_;
+        buckets_[0] = alloc_level(addr_capacity_);
+        buckets_[1] = alloc_level(addr_capacity_ / 2);
+        printf("Level hashing: ASSOC_NUM %zu, KEY_LEN %zu, VALUE_LEN %zu\n", Assoc, sizeof(Key), sizeof(Value));
+        printf("The number of top-level buckets: %lu\n", (unsigned long)addr_capacity_);
+        printf("The number of all buckets: %lu\n", (unsigned long)total_capacity());
+        printf("The number of all entries: %lu\n", (unsigned long)(total_capacity() * Assoc));
+        printf("The level hash table initialization succeeds!\n");
+    }
+
+    LevelHash(const LevelHash &) = delete;
+    LevelHash &operator=(const LevelHash &) = delete;
+
+    /*
+    Function: insert()
+            Insert a key-value item; return false if the table is full and needs expand()
+    */
+    bool insert(const Key &key, const Value &value) {
+        modify_guard guard(lock_);
+        uint64_t f_hash, s_hash;
+        hashes(key, f_hash, s_hash);
+        bucket_guard held(*this, f_hash, s_hash);
+        return insert_item(key, value, f_hash, s_hash, &held);
+    }
+
+    /*
+    Function: find()
+            Lookup a key via static search scheme, top level first, and copy its value out
+    */
+    bool find(const Key &key, Value &value) {
+        detail::read_guard<ConcurrencyPolicy> guard(lock_);
+        uint64_t f_hash, s_hash;
+        hashes(key, f_hash, s_hash);
+        bucket_guard held(*this, f_hash, s_hash);
+        bucket *b;
+        int j = locate(key, f_hash, s_hash, &b);
+        if (j < 0)
+            return false;
+        value = b->slot[j].value;
+        return true;
+    }
+
+    /*
+    Function: update()
+            Update the value of a key; like the opportunistic log-free update of persistent_level_hashing/,
+            the new item is written to an empty slot of the same bucket and both token bits flip in one
+            store when there is one, and the value is overwritten in place otherwise
+    */
+    bool update(const Key &key, const Value &new_value) {
+        modify_guard guard(lock_);
+        uint64_t f_hash, s_hash;
+        hashes(key, f_hash, s_hash);
+        bucket_guard held(*this, f_hash, s_hash);
+        bucket *b;
+        int j = locate(key, f_hash, s_hash, &b);
+        if (j < 0)
+            return false;
+        int k = find_empty(*b);
+        if (k < 0) {
+            b->slot[j].value = new_value;
+            PersistencePolicy::persist(&b->slot[j].value, sizeof(Value));
+            PersistencePolicy::fence();
+            return true;
+        }
+        b->slot[k].key = key;
+        b->slot[k].value = new_value;
+        PersistencePolicy::persist(&b->slot[k], sizeof(entry));
+        PersistencePolicy::fence();
+        b->token ^= token_type(token_type(1) << j) | token_type(token_type(1) << k);
+        PersistencePolicy::persist(&b->token, sizeof(token_type));
+        PersistencePolicy::fence();
+        return true;
+    }
+
+    /*
+    Function: erase()
+            Remove a key-value item; return false if the key is absent
+    */
+    bool erase(const Key &key) {
+        modify_guard guard(lock_);
+        uint64_t f_hash, s_hash;
+        hashes(key, f_hash, s_hash);
+        bucket_guard held(*this, f_hash, s_hash);
+        bucket *b;
+        int level_num;
+        int j = locate(key, f_hash, s_hash, &b, &level_num);
+        if (j < 0)
+            return false;
+        clear_token(*b, j);
+        level_item_num_[level_num] --;
+        return true;
+    }
+
+    /*
+    Function: expand()
+            Double the table: the new top level has twice the buckets of the old top level, which becomes
+            the bottom level, and only the items of the old bottom level are rehashed
+    */
+    void expand() {
+        detail::write_guard<ConcurrencyPolicy> guard(lock_);
+        uint64_t new_capacity = addr_capacity_ * 2;
+        level_ptr new_buckets = alloc_level(new_capacity);
+        uint64_t new_level_item_num = 0;
+
+        for (uint64_t old_idx = 0; old_idx < addr_capacity_ / 2; old_idx ++) {
+            bucket &old_bucket = buckets_[1][old_idx];
+            detail::unroll<Assoc>([&](auto i) {
+                if (!(old_bucket.token & (token_type(1) << i)))
+                    return false;
+                uint64_t f_hash, s_hash;
+                hashes(old_bucket.slot[i].key, f_hash, s_hash);
+                if (!store_in_pair(new_buckets[f_hash & (new_capacity - 1)], new_buckets[s_hash & (new_capacity - 1)],
+                                   old_bucket.slot[i].key, old_bucket.slot[i].value)) {
+                    printf("The expanding fails: 3\n");
+                    exit(1);
+                }
+                new_level_item_num ++;
+                return false;
+            });
+        }
+
+        level_size_ ++;
+        addr_capacity_ = new_capacity;
+        buckets_[1] = std::move(buckets_[0]);
+        buckets_[0] = std::move(new_buckets);
+        level_item_num_[1] = uint64_t(level_item_num_[0]);
+        level_item_num_[0] = new_level_item_num;
+        level_expand_time_ ++;
+    }
+
+    /*
+    Function: shrink()
+            Halve the table: the bottom level becomes the top level and the items of the old top level
+            are reinserted into a new bottom level
+    */
+    void shrink() {
+        detail::write_guard<ConcurrencyPolicy> guard(lock_);
+        // The shrinking is performed only when the hash table has very few items.
+        if (size() > total_capacity() * Assoc * 0.4 || level_size_ < 2) {
+            printf("The shrinking fails: 2\n");
+            exit(1);
+        }
+
+        level_ptr interim_buckets = std::move(buckets_[0]);
+        uint64_t interim_capacity = addr_capacity_;
+        level_size_ --;
+        addr_capacity_ /= 2;
+        buckets_[0] = std::move(buckets_[1]);
+        buckets_[1] = alloc_level(addr_capacity_ / 2);
+        level_item_num_[0] = uint64_t(level_item_num_[1]);
+        level_item_num_[1] = 0;
+        level_expand_time_ = 0;
+
+        for (uint64_t old_idx = 0; old_idx < interim_capacity; old_idx ++) {
+            bucket &old_bucket = interim_buckets[old_idx];
+            detail::unroll<Assoc>([&](auto i) {
+                if (!(old_bucket.token & (token_type(1) << i)))
+                    return false;
+                uint64_t f_hash, s_hash;
+                hashes(old_bucket.slot[i].key, f_hash, s_hash);
+                if (!insert_item(old_bucket.slot[i].key, old_bucket.slot[i].value, f_hash, s_hash)) {
+                    printf("The shrinking fails: 3\n");
+                    exit(1);
+                }
+                return false;
+            });
+        }
+    }
+
+    uint64_t size() const { return level_item_num_[0] + level_item_num_[1]; }
+    uint64_t level_item_num(int level_num) const { return level_item_num_[level_num]; }
+    uint64_t addr_capacity() const { return addr_capacity_; }
+    uint64_t total_capacity() const { return addr_capacity_ + addr_capacity_ / 2; }
+    double load_factor() const { return double(size()) / (total_capacity() * Assoc); }
+
+private:
+    // Destroy the buckets of a level and return its memory to the persistence policy
+    struct level_deleter {
+        uint64_t bucket_num = 0;
+        void operator()(bucket *level) const {
+            for (uint64_t i = 0; i < bucket_num; i ++)
+                level[i].~bucket();
+            PersistencePolicy::deallocate(level, bucket_num * sizeof(bucket));
+        }
+    };
+    using level_ptr = std::unique_ptr<bucket[], level_deleter>;
+
+    static level_ptr alloc_level(uint64_t bucket_num) {
+        bucket *level = static_cast<bucket *>(PersistencePolicy::allocate(bucket_num * sizeof(bucket)));
+        if (!level) {
+            printf("The level allocation fails\n");
+            exit(1);
+        }
+        for (uint64_t i = 0; i < bucket_num; i ++)
+            new (&level[i]) bucket();
+        PersistencePolicy::persist(level, bucket_num * sizeof(bucket));
+        PersistencePolicy::fence();
+        return level_ptr(level, level_deleter{bucket_num});
+    }
+
+    // Modifications take the table-wide lock exclusively unless the policy lets them lock their buckets instead
+    using modify_guard = std::conditional_t<ConcurrencyPolicy::parallel_modify,
+                                            detail::read_guard<ConcurrencyPolicy>, detail::write_guard<ConcurrencyPolicy>>;
+
+    // Lock the four candidate buckets of a key in address order, each once, for the duration of an operation
+    class bucket_guard {
+    public:
+        bucket_guard(LevelHash &table, uint64_t f_hash, uint64_t s_hash) {
+            if (!ConcurrencyPolicy::parallel_modify)
+                return;
+            for (int i = 0; i < 2; i ++) {
+                add(&table.buckets_[i][table.f_idx(f_hash, i)]);
+                add(&table.buckets_[i][table.s_idx(s_hash, i)]);
+            }
+            for (int i = 0; i < num_; i ++)
+                ConcurrencyPolicy::lock(*held_[i]);
+        }
+        ~bucket_guard() {
+            for (int i = 0; i < num_; i ++)
+                ConcurrencyPolicy::unlock(*held_[i]);
+        }
+        bool holds(const bucket *b) const {
+            for (int i = 0; i < num_; i ++)
+                if (held_[i] == b)
+                    return true;
+            return false;
+        }
+        bucket_guard(const bucket_guard &) = delete;
+        bucket_guard &operator=(const bucket_guard &) = delete;
+
+    private:
+        void add(bucket *b) {
+            int i = num_;
+            for (; i > 0 && held_[i - 1] >= b; i --)
+                if (held_[i - 1] == b)
+                    return;
+            for (int k = num_; k > i; k --)
+                held_[k] = held_[k - 1];
+            held_[i] = b;
+            num_ ++;
+        }
+        bucket *held_[4];
+        int num_ = 0;
+    };
+
+    // Lock a bucket that an operation holding the buckets in held moves an item to; without held, the
+    // caller holds the table exclusively; return false if another operation holds the bucket
+    static bool lock_target(const bucket_guard *held, bucket &b) {
+        return !ConcurrencyPolicy::parallel_modify || !held || held->holds(&b) || ConcurrencyPolicy::try_lock(b);
+    }
+
+    static void unlock_target(const bucket_guard *held, bucket &b) {
+        if (ConcurrencyPolicy::parallel_modify && held && !held->holds(&b))
+            ConcurrencyPolicy::unlock(b);
+    }
+
+    void hashes(const Key &key, uint64_t &f_hash, uint64_t &s_hash) const {
+        uint64_t h = hash_(key);
+        f_hash = detail::fmix64(h ^ f_seed_);
+        s_hash = detail::fmix64(h ^ s_seed_);
+    }
+
+    uint64_t f_idx(uint64_t f_hash, int level_num) const { return f_hash & ((addr_capacity_ >> level_num) - 1); }
+    uint64_t s_idx(uint64_t s_hash, int level_num) const { return s_hash & ((addr_capacity_ >> level_num) - 1); }
+
+    static int find_slot(const bucket &b, const Key &key) {
+        int found = -1;
+        detail::unroll<Assoc>([&](auto i) {
+            if ((b.token & (token_type(1) << i)) && b.slot[i].key == key) {
+                found = i;
+                return true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    static int find_empty(const bucket &b) {
+        int found = -1;
+        detail::unroll<Assoc>([&](auto i) {
+            if (!(b.token & (token_type(1) << i))) {
+                found = i;
+                return true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    // Write an item into slot j, then publish it by setting its token bit
+    static void store(bucket &b, int j, const Key &key, const Value &value) {
+        b.slot[j].key = key;
+        b.slot[j].value = value;
+        PersistencePolicy::persist(&b.slot[j], sizeof(entry));
+        PersistencePolicy::fence();
+        b.token |= token_type(token_type(1) << j);
+        PersistencePolicy::persist(&b.token, sizeof(token_type));
+        PersistencePolicy::fence();
+    }
+
+    static bool store_in(bucket &b, const Key &key, const Value &value) {
+        int j = find_empty(b);
+        if (j < 0)
+            return false;
+        store(b, j, key, value);
+        return true;
+    }
+
+    /*  The item is inserted into the first empty slot of its two hash locations, 
+        by checking the j-th slots of both buckets before the (j+1)-th ones
+    */
+    static bool store_in_pair(bucket &f_bucket, bucket &s_bucket, const Key &key, const Value &value) {
+        return detail::unroll<Assoc>([&](auto j) {
+            if (!(f_bucket.token & (token_type(1) << j))) {
+                store(f_bucket, j, key, value);
+                return true;
+            }
+            if (!(s_bucket.token & (token_type(1) << j))) {
+                store(s_bucket, j, key, value);
+                return true;
+            }
+            return false;
+        });
+    }
+
+    static void clear_token(bucket &b, int j) {
+        b.token &= token_type(~(token_type(1) << j));
+        PersistencePolicy::persist(&b.token, sizeof(token_type));
+        PersistencePolicy::fence();
+    }
+
+    // Find the slot of a key and its bucket and level, top level first; return -1 if the key is absent
+    int locate(const Key &key, uint64_t f_hash, uint64_t s_hash, bucket **b, int *level_num = nullptr) {
+        for (int i = 0; i < 2; i ++) {
+            if (level_num)
+                *level_num = i;
+            *b = &buckets_[i][f_idx(f_hash, i)];
+            int j = find_slot(**b, key);
+            if (j >= 0)
+                return j;
+            *b = &buckets_[i][s_idx(s_hash, i)];
+            j = find_slot(**b, key);
+            if (j >= 0)
+                return j;
+        }
+        return -1;
+    }
+
+    // held is the guard of the caller's buckets, or nullptr if the caller holds the table exclusively
+    bool insert_item(const Key &key, const Value &value, uint64_t f_hash, uint64_t s_hash, const bucket_guard *held = nullptr) {
+        for (int i = 0; i < 2; i ++) {
+            if (store_in_pair(buckets_[i][f_idx(f_hash, i)], buckets_[i][s_idx(s_hash, i)], key, value)) {
+                level_item_num_[i] ++;
+                return true;
+            }
+        }
+
+        for (int i = 0; i < 2; i ++) {
+            if (try_movement(f_idx(f_hash, i), i, key, value, held) || try_movement(s_idx(s_hash, i), i, key, value, held)) {
+                level_item_num_[i] ++;
+                return true;
+            }
+        }
+
+        if (level_expand_time_ > 0) {
+            uint64_t idx[2] = {f_idx(f_hash, 1), s_idx(s_hash, 1)};
+            for (uint64_t k : idx) {
+                int j = b2t_movement(k, held);
+                if (j >= 0) {
+                    store(buckets_[1][k], j, key, value);
+                    level_item_num_[1] ++;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Move an item of bucket idx to its alternative bucket in the same level, and put the new item in its slot
+    bool try_movement(uint64_t idx, int level_num, const Key &key, const Value &value, const bucket_guard *held) {
+        bucket &b = buckets_[level_num][idx];
+        return detail::unroll<Assoc>([&](auto i) {
+            uint64_t f_hash, s_hash;
+            hashes(b.slot[i].key, f_hash, s_hash);
+            uint64_t jdx = f_idx(f_hash, level_num) == idx ? s_idx(s_hash, level_num) : f_idx(f_hash, level_num);
+            bucket &target = buckets_[level_num][jdx];
+            if (jdx == idx || !lock_target(held, target))
+                return false;
+            bool moved = store_in(target, b.slot[i].key, b.slot[i].value);
+            unlock_target(held, target);
+            if (!moved)
+                return false;
+            // The movement is finished and then the new item is inserted
+            clear_token(b, i);
+            store(b, i, key, value);
+            return true;
+        });
+    }
+
+    // Move an item of bottom-level bucket idx to one of its top-level buckets; return the freed slot or -1
+    int b2t_movement(uint64_t idx, const bucket_guard *held) {
+        bucket &b = buckets_[1][idx];
+        int freed = -1;
+        detail::unroll<Assoc>([&](auto i) {
+            uint64_t f_hash, s_hash;
+            hashes(b.slot[i].key, f_hash, s_hash);
+            bucket &f_bucket = buckets_[0][f_idx(f_hash, 0)];
+            bucket &s_bucket = buckets_[0][s_idx(s_hash, 0)];
+            // The two buckets are locked in address order like those of an operation
+            bucket &first = &f_bucket < &s_bucket ? f_bucket : s_bucket;
+            bucket &second = &f_bucket < &s_bucket ? s_bucket : f_bucket;
+            if (!lock_target(held, first))
+                return false;
+            if (&second != &first && !lock_target(held, second)) {
+                unlock_target(held, first);
+                return false;
+            }
+            bool moved = store_in_pair(f_bucket, s_bucket, b.slot[i].key, b.slot[i].value);
+            if (&second != &first)
+                unlock_target(held, second);
+            unlock_target(held, first);
+            if (!moved)
+                return false;
+            clear_token(b, i);
+            level_item_num_[0] ++;
+            level_item_num_[1] --;
+            freed = i;
+            return true;
+        });
+        return freed;
+    }
+
+    using counter = std::conditional_t<ConcurrencyPolicy::parallel_modify, std::atomic<uint64_t>, uint64_t>;
+
+    level_ptr buckets_[2];                          // The top level and bottom level in the Level hash table
+    counter level_item_num_[2] = {0, 0};            // The numbers of items stored in the top and bottom levels respectively
+    Hash hash_;
+    uint64_t level_size_;                           // level_size = log2(addr_capacity)
+    uint64_t addr_capacity_;                        // The number of buckets in the top level
+    uint64_t level_expand_time_ = 0;                // The number of expansions since the last shrinking
+    uint64_t f_seed_, s_seed_;                      // Two randomized seeds for hash functions
+    ConcurrencyPolicy lock_;
+};
+
+} // namespace level
+
+#endif
@@ -0,0 +1,168 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include "level_hash.hpp"
+
+/*  Test:
+    This is a simple test example to test the creation, insertion, search, deletion, update in Level hashing
+    for one instantiation of the LevelHash template
+*/
+template <class Table, class MakeKey>
+static void run_test(const char *name, uint64_t level_size, uint64_t insert_num, MakeKey make_key)
+{
+    printf("==== %s ====\n", name);
+    Table level(level_size);
+    uint64_t inserted = 0, i = 0;
+
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        while (!level.insert(make_key(i), i))
+        {
+            printf("Expanding: space utilization & total entries: %f  %lu\n", \
+                level.load_factor(), (unsigned long)(level.total_capacity() * Table::assoc));
+            level.expand();
+        }
+        inserted ++;
+    }
+    printf("%lu items are inserted\n", (unsigned long)inserted);
+
+    printf("The search test begins ...\n");
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        uint64_t value;
+        if (!level.find(make_key(i), value) || value != i)
+            printf("Search the key %lu: ERROR! \n", (unsigned long)i);
+    }
+
+    printf("The update test begins ...\n");
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        uint64_t value;
+        if (!level.update(make_key(i), i * 2) || !level.find(make_key(i), value) || value != i * 2)
+            printf("Update the value of the key %lu: ERROR! \n", (unsigned long)i);
+    }
+
+    printf("The deletion test begins ...\n");
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        if (!level.erase(make_key(i)))
+            printf("Delete the key %lu: ERROR! \n", (unsigned long)i);
+    }
+
+    printf("The number of items stored in the level hash table: %lu\n", (unsigned long)level.size());
+
+    printf("The shrinking test begins ...\n");
+    for (i = 1; i < insert_num / 8 + 1; i ++)
+        level.insert(make_key(i), i);
+    level.shrink();
+    for (i = 1; i < insert_num / 8 + 1; i ++)
+    {
+        uint64_t value;
+        if (!level.find(make_key(i), value) || value != i)
+            printf("Search the key %lu after shrinking: ERROR! \n", (unsigned long)i);
+    }
+}
+
+/*  Test:
+    Several threads search a table sharing a reader-writer lock while one thread updates it
+*/
+static void run_concurrent_test(uint64_t level_size, uint64_t insert_num)
+{
+    printf("==== concurrent search and update ====\n");
+    level::LevelHash<uint64_t, uint64_t, 8, level::shared_lock> level(level_size);
+    uint64_t i;
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        while (!level.insert(i, i))
+            level.expand();
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t ++)
+    {
+        threads.emplace_back([&level, insert_num] {
+            for (uint64_t k = 1; k < insert_num + 1; k ++) {
+                uint64_t value;
+                if (!level.find(k, value) || (value != k && value != k * 2))
+                    printf("Search the key %lu: ERROR! \n", (unsigned long)k);
+            }
+        });
+    }
+    for (i = 1; i < insert_num + 1; i ++)
+        level.update(i, i * 2);
+    for (auto &thread : threads)
+        thread.join();
+    printf("The number of items stored in the level hash table: %lu\n", (unsigned long)level.size());
+}
+
+/*  Test:
+    Several threads insert, search, update and delete disjoint keys of a table locking single buckets,
+    and expand it when it is full
+*/
+static void run_bucket_lock_test(uint64_t level_size, uint64_t insert_num)
+{
+    printf("==== concurrent insertion, search, update and deletion with bucket locks ====\n");
+    level::LevelHash<uint64_t, uint64_t, 4, level::bucket_lock> level(level_size);
+    const uint64_t thread_num = 4;
+
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < thread_num; t ++)
+    {
+        threads.emplace_back([&level, insert_num, thread_num, t] {
+            for (uint64_t k = t + 1; k < insert_num + 1; k += thread_num) {
+                while (!level.insert(k, k))
+                    level.expand();
+            }
+            for (uint64_t k = t + 1; k < insert_num + 1; k += thread_num) {
+                uint64_t value;
+                if (!level.find(k, value) || value != k)
+                    printf("Search the key %lu: ERROR! \n", (unsigned long)k);
+                if (!level.update(k, k * 2) || !level.find(k, value) || value != k * 2)
+                    printf("Update the value of the key %lu: ERROR! \n", (unsigned long)k);
+            }
+            for (uint64_t k = t + 1; k < insert_num + 1; k += 2 * thread_num) {
+                if (!level.erase(k))
+                    printf("Delete the key %lu: ERROR! \n", (unsigned long)k);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    uint64_t i, remaining = 0;
+    for (i = 1; i < insert_num + 1; i ++)
+    {
+        uint64_t value = 0;
+        bool erased = (i - 1) % (2 * thread_num) < thread_num;
+        if (level.find(i, value) != !erased || (!erased && value != i * 2))
+            printf("Search the key %lu after the threads: ERROR! \n", (unsigned long)i);
+        remaining += !erased;
+    }
+    if (level.size() != remaining)
+        printf("Count the items: ERROR! \n");
+    printf("The number of items stored in the level hash table: %lu\n", (unsigned long)level.size());
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <level_size> <insert_num>\n", argv[0]);
+        return 1;
+    }
+    uint64_t level_size = atoi(argv[1]);                // INPUT: the number of addressable buckets is 2^level_size
+    uint64_t insert_num = atoi(argv[2]);                // INPUT: the number of items to be inserted
+
+    auto integer_key = [](uint64_t i) { return i; };
+    auto string_key = [](uint64_t i) { return std::to_string(i); };
+
+    run_test<level::LevelHash<uint64_t, uint64_t>>("integer keys, 4 slots per bucket", level_size, insert_num, integer_key);
+    run_test<level::LevelHash<uint64_t, uint64_t, 8>>("integer keys, 8 slots per bucket", level_size, insert_num, integer_key);
+    run_test<level::LevelHash<std::string, uint64_t, 4>>("string keys, 4 slots per bucket", level_size, insert_num, string_key);
+    run_test<level::LevelHash<uint64_t, uint64_t, 4, level::no_lock, level::clflush_flush>>("integer keys, flushed", \
+        level_size, insert_num / 10, integer_key);
+    run_concurrent_test(level_size, insert_num);
+    run_bucket_lock_test(level_size, insert_num);
+
+    return 0;
+}